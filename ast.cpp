@@ -1,9 +1,71 @@
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include <sstream>
 #include <utility>
 #include "ast.h"
 
+namespace {
+    // each node is preceded by a word telling where its memory came from
+    enum class Origin : std::size_t {
+        Heap,
+        Arena,
+    };
+    constexpr std::size_t HEADER = sizeof(Origin);
+    constexpr std::size_t CHUNK = 64 * 1024;
+    static_assert(alignof(ast::Parallel) <= HEADER && alignof(ast::Repeat) <= HEADER, "nodes must stay aligned after the header");
+}
+
+thread_local ast::Arena * ast::Arena::current = nullptr;
+
+void * ast::Arena::allocate(std::size_t size) {
+    size = (size + HEADER - 1) / HEADER * HEADER;
+    if (free == nullptr || static_cast<std::size_t>(limit - free) < size) {
+        auto chunkSize = std::max(CHUNK, size);
+        chunks.push_back(std::make_unique<char[]>(chunkSize));
+        free = chunks.back().get();
+        limit = free + chunkSize;
+    }
+    auto ptr = free;
+    free += size;
+    used += size;
+    return ptr;
+}
+
+std::size_t ast::Arena::bytes() const {
+    return used;
+}
+
+ast::Arena * ast::Arena::installed() {
+    return current;
+}
+
+ast::Arena::Scope::Scope(ast::Arena & arena) : previous(current) {
+    current = &arena;
+}
+
+ast::Arena::Scope::~Scope() {
+    current = previous;
+}
+
+void * ast::Elem::operator new(std::size_t size) {
+    auto arena = Arena::installed();
+    auto origin = arena != nullptr ? Origin::Arena : Origin::Heap;
+    void * memory = arena != nullptr ? arena->allocate(HEADER + size) : ::operator new(HEADER + size);
+    *static_cast<Origin *>(memory) = origin;
+    return static_cast<char *>(memory) + HEADER;
+}
+
+void ast::Elem::operator delete(void * ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    void * memory = static_cast<char *>(ptr) - HEADER;
+    if (*static_cast<Origin *>(memory) == Origin::Heap) {
+        ::operator delete(memory);
+    }
+}
+
 ast::NewObject::NewObject(std::string name) : name(std::move(name)) {}
 
 void ast::NewObject::print(std::ostream & out) const {
@@ -68,12 +130,17 @@ void ast::EndOfLife::accept(ast::Statement::Visitor & visitor) {
     visitor.visitEndOfLife(*this);
 }
 
-ast::NewThread::NewThread(std::vector<std::unique_ptr<Statement>> && body)
-        : body(std::move(body)) {}
+ast::NewThread::NewThread(std::string handle, std::vector<std::unique_ptr<Statement>> && body)
+        : handle(std::move(handle))
+        , body(std::make_shared<std::vector<std::unique_ptr<Statement>>>(std::move(body)))
+        , usedVars(std::make_shared<std::unordered_set<std::string>>()) {}
 
 void ast::NewThread::print(std::ostream & out) const {
+    if (!handle.empty()) {
+        out << handle << " = ";
+    }
     out << "thread {" << std::endl;
-    for (auto const & stat: body) {
+    for (auto const & stat: *body) {
         out << "    ";
         stat->print(out);
         out << std::endl;
@@ -85,6 +152,61 @@ void ast::NewThread::accept(ast::Statement::Visitor & visitor) {
     visitor.visitNewThread(*this);
 }
 
+ast::Repeat::Repeat(uint times, std::string counter, std::vector<std::unique_ptr<Statement>> && body)
+        : times(times)
+        , counter(std::move(counter))
+        , body(std::move(body)) {}
+
+void ast::Repeat::print(std::ostream & out) const {
+    out << "repeat " << times << " " << counter << " {" << std::endl;
+    for (auto const & stat: body) {
+        out << "    ";
+        stat->print(out);
+        out << std::endl;
+    }
+    out << "}";
+}
+
+void ast::Repeat::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitRepeat(*this);
+}
+
+std::string ast::Repeat::expand(std::string const & name, Counters const & counters) {
+    auto result = name;
+    for (auto iter = counters.rbegin(); iter != counters.rend() && result.find('$') != std::string::npos; iter++) {
+        auto placeholder = "$" + iter->first;
+        auto value = std::to_string(iter->second);
+        for (auto pos = result.find(placeholder); pos != std::string::npos; pos = result.find(placeholder, pos + value.length())) {
+            result.replace(pos, placeholder.length(), value);
+        }
+    }
+    return result;
+}
+
+ast::Join::Join(std::string handle) : handle(std::move(handle)) {}
+
+void ast::Join::print(std::ostream & out) const {
+    out << "join ";
+    if (handle.empty()) {
+        out << "all";
+    } else {
+        out << handle;
+    }
+}
+
+void ast::Join::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitJoin(*this);
+}
+
+ast::Checkpoint::Checkpoint(std::string path) : path(std::move(path)) {}
+
+void ast::Checkpoint::print(std::ostream & out) const {
+    out << "checkpoint \"" << path << "\"";
+}
+
+void ast::Checkpoint::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitCheckpoint(*this);
+}
 
 ast::Dump::Dump(std::unique_ptr<Expression> expr) : expr(std::move(expr)) {}
 
@@ -97,6 +219,17 @@ void ast::Dump::accept(ast::Statement::Visitor & visitor) {
     visitor.visitDump(*this);
 }
 
+ast::Freeze::Freeze(std::unique_ptr<Expression> expr) : expr(std::move(expr)) {}
+
+void ast::Freeze::print(std::ostream & out) const {
+    out << "freeze ";
+    expr->print(out);
+}
+
+void ast::Freeze::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitFreeze(*this);
+}
+
 void ast::Sleep::print(std::ostream & out) const {
     out << "sleep";
 }
@@ -113,6 +246,43 @@ void ast::Sleepr::accept(ast::Statement::Visitor & visitor) {
     visitor.visitSleepr(*this);
 }
 
+void ast::Stats::print(std::ostream & out) const {
+    out << "stats";
+}
+
+void ast::Stats::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitStats(*this);
+}
+
+ast::Parallel::Parallel(std::vector<std::unique_ptr<Statement>> && body, std::vector<std::vector<Part>> && groups, std::unordered_set<std::string> && usedVars)
+        : body(std::move(body))
+        , groups(std::move(groups))
+        , usedVars(std::move(usedVars)) {}
+
+void ast::Parallel::print(std::ostream & out) const {
+    out << "parallel {" << std::endl;
+    for (auto const & group: groups) {
+        out << "    group";
+        for (auto const & part: group) {
+            out << " " << part.stat;
+            if (dynamic_cast<Repeat *>(body[part.stat].get()) != nullptr) {
+                out << "[" << part.begin << ", " << part.end << ")";
+            }
+        }
+        out << std::endl;
+    }
+    for (auto const & stat: body) {
+        out << "    ";
+        stat->print(out);
+        out << std::endl;
+    }
+    out << "}";
+}
+
+void ast::Parallel::accept(ast::Statement::Visitor & visitor) {
+    visitor.visitParallel(*this);
+}
+
 void ast::Statement::Visitor::visitAssign(ast::Assign & assign) {
     visitStatement(assign);
 }
@@ -121,6 +291,18 @@ void ast::Statement::Visitor::visitNewThread(ast::NewThread & newThread) {
     visitStatement(newThread);
 }
 
+void ast::Statement::Visitor::visitRepeat(ast::Repeat & repeat) {
+    visitStatement(repeat);
+}
+
+void ast::Statement::Visitor::visitJoin(ast::Join & join) {
+    visitStatement(join);
+}
+
+void ast::Statement::Visitor::visitCheckpoint(ast::Checkpoint & checkpoint) {
+    visitStatement(checkpoint);
+}
+
 void ast::Statement::Visitor::visitSleep(ast::Sleep & sleep) {
     visitStatement(sleep);
 }
@@ -133,10 +315,22 @@ void ast::Statement::Visitor::visitDump(ast::Dump & dump) {
     visitStatement(dump);
 }
 
+void ast::Statement::Visitor::visitStats(ast::Stats & stats) {
+    visitStatement(stats);
+}
+
+void ast::Statement::Visitor::visitFreeze(ast::Freeze & freeze) {
+    visitStatement(freeze);
+}
+
 void ast::Statement::Visitor::visitEndOfLife(ast::EndOfLife & endOfLife) {
     visitStatement(endOfLife);
 }
 
+void ast::Statement::Visitor::visitParallel(ast::Parallel & parallel) {
+    visitStatement(parallel);
+}
+
 void ast::Statement::Visitor::visitStatement(ast::Statement & stat) {
     assert(false);
 }
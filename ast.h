@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -7,10 +8,55 @@
 #include <memory>
 
 namespace ast {
+    /**
+     * Memory for the nodes of a program: they are laid out one after another in the order they are created,
+     * and released all at once along with the arena.
+     * Nodes created on a thread while an arena is installed there by `Arena::Scope` are placed into it,
+     * the others are allocated on the heap one by one.
+     * Deleting a node of an arena only runs its destructor, so the arena must outlive its nodes.
+     */
+    class Arena {
+    public:
+        Arena() = default;
+        Arena(Arena const & that) = delete;
+        Arena & operator =(Arena const & that) = delete;
+
+        void * allocate(std::size_t size);
+        /**
+         * Bytes taken by the nodes so far.
+         */
+        [[nodiscard]] std::size_t bytes() const;
+        /**
+         * The arena installed on the current thread, if any.
+         */
+        static Arena * installed();
+
+        class Scope {
+        public:
+            explicit Scope(Arena & arena);
+            Scope(Scope const & that) = delete;
+            Scope & operator =(Scope const & that) = delete;
+            ~Scope();
+        private:
+            Arena * const previous;
+        };
+    private:
+        static thread_local Arena * current;
+
+        std::vector<std::unique_ptr<char[]>> chunks;
+        char * free = nullptr;
+        char * limit = nullptr;
+        std::size_t used = 0;
+    };
+
     class Elem {
     public:
         virtual ~Elem() = default;
         virtual void print(std::ostream & out) const = 0;
+
+        // in the installed arena, if any
+        static void * operator new(std::size_t size);
+        static void operator delete(void * ptr);
     };
 
     class Expression : public Elem {
@@ -34,6 +80,8 @@ namespace ast {
         void accept(Visitor & visitor) override;
 
         std::string name;
+        // set by the preparation if objects created here can never be seen by another thread
+        bool threadLocal = false;
     };
 
     class Var : public AssignableTo {
@@ -77,12 +125,69 @@ namespace ast {
 
     class NewThread : public Statement {
     public:
-        explicit NewThread(std::vector<std::unique_ptr<Statement>> && body);
+        /**
+         * @param handle a name to `join` the thread by, empty for an anonymous thread.
+         */
+        NewThread(std::string handle, std::vector<std::unique_ptr<Statement>> && body);
         void print(std::ostream & out) const override;
         void accept(Visitor & visitor) override;
 
-        std::vector<std::unique_ptr<Statement>> const body;
-        std::unordered_set<std::string> usedVars;
+        std::string const handle;
+        // once prepared, threads with identical bodies share one body and one capture set
+        std::shared_ptr<std::vector<std::unique_ptr<Statement>>> body;
+        std::shared_ptr<std::unordered_set<std::string>> usedVars;
+    };
+
+    /**
+     * `repeat N counter { ... }`.
+     * Names in the body may refer to the current iteration (zero-based) of an enclosing loop as `$counter`.
+     */
+    class Repeat : public Statement {
+    public:
+        /**
+         * Current values of the counters of the enclosing loops, the innermost last.
+         */
+        using Counters = std::vector<std::pair<std::string, uint>>;
+
+        Repeat(uint times, std::string counter, std::vector<std::unique_ptr<Statement>> && body);
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+        /**
+         * Substitutes counter values into a name, starting with the innermost loop.
+         * Placeholders of unknown counters are left as is.
+         */
+        static std::string expand(std::string const & name, Counters const & counters);
+
+        uint const times;
+        std::string const counter;
+        std::vector<std::unique_ptr<Statement>> body;
+    };
+
+    /**
+     * `join handle` or `join all`.
+     */
+    class Join : public Statement {
+    public:
+        /**
+         * @param handle of the thread to wait for, empty to wait for all the started threads.
+         */
+        explicit Join(std::string handle);
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+
+        std::string const handle;
+    };
+
+    /**
+     * `checkpoint "path"`, saves all the variables defined so far, along with the objects they reach, into a heap image.
+     */
+    class Checkpoint : public Statement {
+    public:
+        explicit Checkpoint(std::string path);
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+
+        std::string const path;
     };
 
     class Sleep : public Statement {
@@ -97,6 +202,15 @@ namespace ast {
         void accept(Visitor & visitor) override;
     };
 
+    /**
+     * `stats`, prints how many operations of each kind the memory manager has done so far, in the whole process.
+     */
+    class Stats : public Statement {
+    public:
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+    };
+
     class Dump : public Statement {
     public:
         explicit Dump(std::unique_ptr<Expression> expr);
@@ -106,14 +220,57 @@ namespace ast {
         std::unique_ptr<Expression> expr;
     };
 
+    /**
+     * `freeze x`, makes the set of fields of an object immutable, so that they are read without locking.
+     */
+    class Freeze : public Statement {
+    public:
+        explicit Freeze(std::unique_ptr<Expression> expr);
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+
+        std::unique_ptr<Expression> expr;
+    };
+
+    /**
+     * Independent top-level statements, run by several threads at once.
+     * Never written by hand, the preparation groups statements which touch disjoint sets of variables.
+     */
+    class Parallel : public Statement {
+    public:
+        /**
+         * A statement of the body, or a range of iterations if it's a loop.
+         */
+        struct Part {
+            std::size_t stat;
+            uint begin;
+            uint end;
+        };
+
+        Parallel(std::vector<std::unique_ptr<Statement>> && body, std::vector<std::vector<Part>> && groups, std::unordered_set<std::string> && usedVars);
+        void print(std::ostream & out) const override;
+        void accept(Visitor & visitor) override;
+
+        std::vector<std::unique_ptr<Statement>> const body;
+        // each group runs on its own thread, in the given order
+        std::vector<std::vector<Part>> const groups;
+        std::unordered_set<std::string> const usedVars;
+    };
+
     class Statement::Visitor  {
     public:
         virtual void visitAssign(Assign & assign);
         virtual void visitNewThread(NewThread & newThread);
+        virtual void visitRepeat(Repeat & repeat);
+        virtual void visitJoin(Join & join);
+        virtual void visitCheckpoint(Checkpoint & checkpoint);
         virtual void visitSleep(Sleep & sleep);
         virtual void visitSleepr(Sleepr & sleepr);
         virtual void visitDump(Dump & dump);
+        virtual void visitStats(Stats & stats);
+        virtual void visitFreeze(Freeze & freeze);
         virtual void visitEndOfLife(EndOfLife & endOfLife);
+        virtual void visitParallel(Parallel & parallel);
         virtual void visitStatement(Statement & stat);
     };
 
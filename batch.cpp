@@ -0,0 +1,64 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "run.h"
+
+struct ScriptResult {
+    std::string path;
+    RunStats stats;
+    std::string output;
+};
+
+bool runBatch(std::string const & dir, uint jobs, std::ostream & report) {
+    std::vector<std::string> paths;
+    for (auto & entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".arc") {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<ScriptResult> results(paths.size());
+    std::atomic<std::size_t> nextScript = 0;
+    std::vector<std::thread> workers;
+    for (uint i = 0; i < std::max(jobs, 1u); ++i) {
+        workers.emplace_back([&]() {
+            for (auto script = nextScript++; script < paths.size(); script = nextScript++) {
+                auto & result = results[script];
+                std::stringstream out;
+                result.path = paths[script];
+                result.stats = runMeasured(getFileContent(result.path), out);
+                result.output = out.str();
+            }
+        });
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    std::size_t failed = 0;
+    for (auto & result : results) {
+        report << "=== " << result.path << ": ";
+        if (result.stats.ok) {
+            report << "ok";
+        } else {
+            report << "error (" << result.stats.error << ")";
+            failed += 1;
+        }
+        report << ", " << result.stats.wallMs << " ms, peak " << result.stats.peakObjects << " objects" << std::endl;
+        report << result.output;
+    }
+    auto wallMs = std::chrono::duration<double, std::milli>(finish - start).count();
+    report << "=== " << results.size() << " scripts, " << results.size() - failed << " ok, " << failed << " failed, "
+           << wallMs << " ms with " << jobs << " jobs" << std::endl;
+    return failed == 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+/**
+ * Runs all the `.arc` scripts from `dir`, `jobs` of them at a time, each with its own interpreter.
+ * Writes the output of each script, along with its wall time and peak of live objects, to `report`.
+ * @return whether all the scripts succeeded.
+ */
+bool runBatch(std::string const & dir, uint jobs, std::ostream & report);
@@ -0,0 +1,160 @@
+#include <benchmark/benchmark.h>
+
+#include <malloc.h>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+
+#include "../parsing/parallel.h"
+#include "../preparation.h"
+#include "../interpreter.h"
+#include "../output.h"
+#include "../tests/helper.h"
+
+/**
+ * A straight-line script of `size` statements, with names long enough not to fit into a string itself.
+ */
+static std::string namedScript(int64_t size) {
+    std::stringstream buf;
+    buf << "root_object = object" << std::endl;
+    for (int64_t i = 1; i < size; ++i) {
+        if (i % 3 == 0) {
+            buf << "dump allocated_object_" << i - 2 << std::endl;
+        } else if (i % 3 == 1) {
+            buf << "allocated_object_" << i << " = object(generation)" << std::endl;
+        } else {
+            buf << "allocated_object_" << i - 1 << ".parent_field = root_object" << std::endl;
+        }
+    }
+    return buf.str();
+}
+
+class NullBuf : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+    std::streamsize xsputn(char const *, std::streamsize n) override {
+        return n;
+    }
+};
+
+/**
+ * A parsed program, its nodes either in an arena or on the heap.
+ */
+struct Parsed {
+    Parsed(std::string const & script, bool inArena) {
+        std::optional<ast::Arena::Scope> scope;
+        if (inArena) {
+            scope.emplace(arena);
+        }
+        auto before = mallinfo2().uordblks;
+        statements = parse(script);
+        bytes = mallinfo2().uordblks - before;
+    }
+
+    ast::Arena arena;
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    std::size_t bytes = 0; // taken from the heap by the parser, including the chunks of the arena
+};
+
+static void BM_Parse(benchmark::State & state, bool inArena) {
+    auto script = namedScript(state.range(0));
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+        Parsed parsed(script, inArena);
+        bytes = parsed.bytes;
+        state.PauseTiming(); // the program is freed off the clock
+        parsed.statements.clear();
+        state.ResumeTiming();
+    }
+    state.counters["ast_bytes"] = static_cast<double>(bytes);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * script.size()));
+}
+BENCHMARK_CAPTURE(BM_Parse, heap, false)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parse, arena, true)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_Free(benchmark::State & state, bool inArena) {
+    auto script = namedScript(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto parsed = std::make_unique<Parsed>(script, inArena);
+        state.ResumeTiming();
+        parsed.reset();
+    }
+}
+BENCHMARK_CAPTURE(BM_Free, heap, false)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Free, arena, true)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_Interpret(benchmark::State & state, bool inArena) {
+    Parsed parsed(namedScript(state.range(0)), inArena);
+    std::unordered_set<std::string> names;
+    {
+        std::optional<ast::Arena::Scope> scope;
+        if (inArena) {
+            scope.emplace(parsed.arena);
+        }
+        names = preprocess(parsed.statements, 1);
+    }
+    NullBuf nullBuf;
+    std::ostream null(&nullBuf);
+    for (auto _ : state) {
+        Output output(null);
+        Interpreter interp(parsed.statements, names, output);
+        interp.interpret();
+        output.flush();
+    }
+}
+BENCHMARK_CAPTURE(BM_Interpret, heap, false)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Interpret, arena, true)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_ParseParallel(benchmark::State & state) {
+    auto script = namedScript(300000);
+    for (auto _ : state) {
+        auto program = std::make_unique<ParsedProgram>(parseParallel(script.c_str(), state.range(0)));
+        state.PauseTiming(); // the program is freed off the clock
+        program.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * script.size()));
+}
+BENCHMARK(BM_ParseParallel)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/**
+ * The shape of `Concurent.CounterIncs`: each thread stores `obj` into its own variables, or into the same ones.
+ */
+static std::string threadsScript(bool identicalBodies) {
+    uint const THREADS = 8;
+    uint const OPS = 1000;
+    return prog({
+        "obj = object",
+        repeat(THREADS, "t", {
+            "thread {",
+                repeat(OPS, "o", {identicalBodies ? "var_$o = obj" : "var_$t_$o = obj"}),
+            "}",
+        }),
+        "join all",
+        "dump obj",
+    });
+}
+
+static void BM_PrepareThreads(benchmark::State & state, bool identicalBodies) {
+    auto script = threadsScript(identicalBodies);
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+        auto before = mallinfo2().uordblks;
+        auto program = std::make_unique<ParsedProgram>(parseParallel(script.c_str(), 1));
+        {
+            ast::Arena::Scope scope(*program->arenas.front());
+            benchmark::DoNotOptimize(preprocess(program->statements, 1));
+        }
+        bytes = mallinfo2().uordblks - before;
+        state.PauseTiming();
+        program.reset();
+        state.ResumeTiming();
+    }
+    state.counters["ast_bytes"] = static_cast<double>(bytes);
+}
+BENCHMARK_CAPTURE(BM_PrepareThreads, distinct, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_PrepareThreads, identical, true)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,91 @@
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <sstream>
+#include <thread>
+
+#include "../cache.h"
+#include "../preparation.h"
+
+/**
+ * A script of `size` statements, most of them at the top level, with a loop and a thread at the end.
+ */
+static std::string startupScript(int64_t size) {
+    std::stringstream buf;
+    buf << "root = object" << std::endl;
+    for (int64_t i = 0; i < size / 2; ++i) {
+        buf << "allocated_" << i << " = object(generation)" << std::endl;
+        buf << "allocated_" << i << ".parent = root" << std::endl;
+    }
+    buf << "repeat 10 i { tmp_$i = object" << std::endl << "dump tmp_$i }" << std::endl;
+    buf << "t = thread { dump root }" << std::endl << "join t" << std::endl;
+    return buf.str();
+}
+
+/**
+ * From the source to the prepared program, as without a cache.
+ */
+static void BM_StartCold(benchmark::State & state) {
+    auto script = startupScript(state.range(0));
+    auto workers = std::thread::hardware_concurrency();
+    for (auto _ : state) {
+        auto program = std::make_unique<ParsedProgram>(parseParallel(script.c_str(), workers));
+        {
+            ast::Arena::Scope scope(*program->arenas.front());
+            benchmark::DoNotOptimize(preprocess(program->statements, workers));
+        }
+        state.PauseTiming();
+        program.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * script.size()));
+}
+BENCHMARK(BM_StartCold)->Arg(10000)->Arg(400000)->Unit(benchmark::kMillisecond);
+
+/**
+ * From the source to the prepared program, taken from a fresh cache.
+ */
+static void BM_StartWarm(benchmark::State & state) {
+    auto script = startupScript(state.range(0));
+    auto workers = std::thread::hardware_concurrency();
+    auto dir = std::filesystem::temp_directory_path() / "arc_bench_cache";
+    ScriptCache cache(dir.string());
+    {
+        std::unordered_set<std::string> globalNames;
+        auto program = parseParallel(script.c_str(), workers);
+        globalNames = preprocess(program.statements, workers);
+        cache.save(script, workers, program, globalNames);
+    }
+    for (auto _ : state) {
+        auto program = std::make_unique<ParsedProgram>();
+        std::unordered_set<std::string> globalNames;
+        if (!cache.load(script, workers, *program, globalNames)) {
+            state.SkipWithError("the program is not cached");
+            break;
+        }
+        state.PauseTiming();
+        program.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * script.size()));
+    std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_StartWarm)->Arg(10000)->Arg(400000)->Unit(benchmark::kMillisecond);
+
+/**
+ * Writing the prepared program into the cache, the extra cost of the first run.
+ */
+static void BM_CacheSave(benchmark::State & state) {
+    auto script = startupScript(state.range(0));
+    auto workers = std::thread::hardware_concurrency();
+    auto dir = std::filesystem::temp_directory_path() / "arc_bench_cache";
+    ScriptCache cache(dir.string());
+    std::unordered_set<std::string> globalNames;
+    auto program = parseParallel(script.c_str(), workers);
+    globalNames = preprocess(program.statements, workers);
+    for (auto _ : state) {
+        cache.save(script, workers, program, globalNames);
+    }
+    std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_CacheSave)->Arg(10000)->Arg(400000)->Unit(benchmark::kMillisecond);
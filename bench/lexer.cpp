@@ -0,0 +1,34 @@
+#include <benchmark/benchmark.h>
+
+#include <sstream>
+
+#include "../parsing/lexer.h"
+
+/**
+ * A script of about `size` bytes, indented and commented the way generated scripts are.
+ */
+static std::string largeScript(int64_t size) {
+    std::stringstream buf;
+    for (int64_t i = 0; buf.tellp() < size; ++i) {
+        buf << "// block " << i << ", allocating the objects of the generation" << std::endl;
+        buf << "repeat 100 iteration_" << i << " {" << std::endl;
+        buf << "        generated_object_$iteration_" << i << " = object(generation_" << i << ")" << std::endl;
+        buf << "        generated_object_$iteration_" << i << ".parent_field ~= previous_generation_" << i << std::endl;
+        buf << "}" << std::endl;
+        buf << "dump generated_object_99_" << i << std::endl;
+    }
+    return buf.str();
+}
+
+static void BM_Lex(benchmark::State & state, scan::Isa isa) {
+    auto script = largeScript(state.range(0));
+    for (auto _ : state) {
+        Lexer lexer(script.c_str(), isa);
+        while (lexer.next().kind != Token::Kind::End) {}
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * script.size()));
+    state.SetLabel(scan::get(isa).isa == isa ? "" : "not supported, fell back");
+}
+BENCHMARK_CAPTURE(BM_Lex, scalar, scan::Isa::Scalar)->Arg(1 << 20)->Arg(16 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Lex, sse2, scan::Isa::Sse2)->Arg(1 << 20)->Arg(16 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Lex, avx2, scan::Isa::Avx2)->Arg(1 << 20)->Arg(16 << 20)->Unit(benchmark::kMillisecond);
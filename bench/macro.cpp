@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../run.h"
+
+/**
+ * Runs generated scripts on 1 to N interpreter threads, each in a process of its own to see its peak RSS,
+ * and writes a JSON object per run, per line, so that the results of two builds can be diffed.
+ */
+
+/**
+ * A script where each of `threads` threads does `ops` operations of the same kind.
+ */
+using Workload = std::function<std::string(uint threads, uint ops)>;
+
+/**
+ * Wraps the body of a thread into a script starting `threads` of them and waiting for them all.
+ * `$t` is the number of the thread and `$o` is the number of the operation, for `ops` operations of the body.
+ */
+static std::string inThreads(std::string const & setup, uint threads, uint ops, std::string const & body) {
+    std::stringstream buf;
+    buf << setup << std::endl;
+    buf << "repeat " << threads << " t {" << std::endl;
+    buf << "thread {" << std::endl;
+    buf << "repeat " << ops << " o {" << std::endl;
+    buf << body << std::endl;
+    buf << "}" << std::endl;
+    buf << "}" << std::endl;
+    buf << "}" << std::endl;
+    buf << "join all" << std::endl;
+    return buf.str();
+}
+
+static std::map<std::string, Workload> const workloads = {
+    // every thread keeps incrementing the counter of the same object
+    {"increments", [](uint threads, uint ops) {
+        return inThreads("obj = object", threads, ops, "var_$t_$o = obj");
+    }},
+    // objects are allocated and freed right away
+    {"churn", [](uint threads, uint ops) {
+        return inThreads("", threads, ops, "tmp_$t = object(churn)\ntmp_$t.child_$o = object(child)");
+    }},
+    // weak references are taken from a weak reference and upgraded
+    {"weak", [](uint threads, uint ops) {
+        // `obj` is used at the end, not to be freed before
+        return inThreads("obj = object\nweak ~= obj", threads, ops, "weak_$t_$o ~= weak\nstrong_$t = weak") + "keep = obj\n";
+    }},
+    // every thread builds a chain of objects and frees it at once
+    {"chains", [](uint threads, uint ops) {
+        auto setup = "repeat " + std::to_string(threads) + " t {\nhead_$t = object\n}";
+        return inThreads(setup, threads, ops, "tail_$t = head_$t\nhead_$t = object\nhead_$t.next = tail_$t")
+               + "repeat " + std::to_string(threads) + " t {\nhead_$t = object\n}\n";
+    }},
+    // every thread references the same object from a wide one and frees it at once
+    {"fanout", [](uint threads, uint ops) {
+        auto script = inThreads("leaf = object\nrepeat " + std::to_string(threads) + " t {\nnode_$t = object\n}",
+                                threads, ops, "node_$t.field_$o = leaf");
+        return script + "repeat " + std::to_string(threads) + " t {\nnode_$t = object\n}\n";
+    }},
+    // all the threads add fields to the same object and read them back
+    {"fields", [](uint threads, uint ops) {
+        return inThreads("obj = object", threads, ops, "obj.field_$t_$o = object\nvar_$t = obj.field_$t_$o");
+    }},
+    // all the threads read the same field of an object, which is frozen or not
+    {"reads", [](uint threads, uint ops) {
+        return inThreads("obj = object\nobj.field = object", threads, ops, "var_$t = obj.field") + "keep = obj\n";
+    }},
+    {"frozen_reads", [](uint threads, uint ops) {
+        return inThreads("obj = object\nobj.field = object\nfreeze obj", threads, ops, "var_$t = obj.field") + "keep = obj\n";
+    }},
+    // a short thread capturing the same object is started for every 100 operations,
+    // threads are started by the main one only, so the storm isn't spread over `threads`
+    {"spawns", [](uint threads, uint ops) {
+        return "obj = object\nrepeat " + std::to_string(threads * std::max(ops / 100, 1u)) + " s {\n"
+               "thread {\nvar_$s = obj\n}\n}\njoin all\n";
+    }},
+};
+
+class NullBuf : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+    std::streamsize xsputn(char const *, std::streamsize n) override {
+        return n;
+    }
+};
+
+static std::string escaped(std::string const & str) {
+    std::string res;
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c == '\n' ? ' ' : c;
+    }
+    return res;
+}
+
+/**
+ * Runs the script in a child process, which writes the result line to `out` itself.
+ * @return whether the run succeeded.
+ */
+static bool runIsolated(std::string const & name, uint threads, uint ops, std::string const & script, std::ostream & out) {
+    out.flush();
+    auto pid = fork();
+    if (pid < 0) {
+        throw std::system_error(errno, std::generic_category(), "fork");
+    }
+    if (pid == 0) {
+        NullBuf nullBuf;
+        std::ostream null(&nullBuf);
+        auto stats = runMeasured(script, null, true);
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        auto throughput = stats.wallMs > 0 ? static_cast<double>(stats.statements) * 1000 / stats.wallMs : 0;
+        out << "{\"workload\": \"" << name << "\", \"threads\": " << threads << ", \"ops\": " << ops
+            << ", \"ok\": " << (stats.ok ? "true" : "false");
+        if (!stats.ok) {
+            out << ", \"error\": \"" << escaped(stats.error) << "\"";
+        }
+        out << ", \"wall_ms\": " << stats.wallMs << ", \"statements\": " << stats.statements
+            << ", \"statements_per_s\": " << throughput
+            << ", \"p50_us\": " << stats.p50StatementUs << ", \"p99_us\": " << stats.p99StatementUs
+            << ", \"peak_objects\": " << stats.peakObjects << ", \"peak_rss_kb\": " << usage.ru_maxrss << "}" << std::endl;
+        _exit(stats.ok ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void printUsageAndDie() {
+    std::cerr << "Usage: arc_macro [--threads <max>] [--ops <per thread>] [--workload <name>]..." << std::endl;
+    std::cerr << "Workloads:";
+    for (auto & [name, _] : workloads) {
+        std::cerr << " " << name;
+    }
+    std::cerr << std::endl;
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
+    auto args = std::vector<std::string>(argv + 1, argv + argc);
+    uint maxThreads = 8;
+    uint ops = 1000;
+    std::vector<std::string> chosen;
+    for (std::size_t i = 0; i < args.size(); i += 2) {
+        if (i + 1 == args.size()) {
+            printUsageAndDie();
+        }
+        if (args[i] == "--threads") {
+            maxThreads = std::max(std::stoul(args[i + 1]), 1ul);
+        } else if (args[i] == "--ops") {
+            ops = std::max(std::stoul(args[i + 1]), 1ul);
+        } else if (args[i] == "--workload" && workloads.count(args[i + 1]) != 0) {
+            chosen.push_back(args[i + 1]);
+        } else {
+            printUsageAndDie();
+        }
+    }
+    if (chosen.empty()) {
+        for (auto & [name, _] : workloads) {
+            chosen.push_back(name);
+        }
+    }
+
+    // the powers of two up to the maximum, and the maximum itself
+    std::vector<uint> threadCounts;
+    for (uint threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    bool ok = true;
+    for (auto & name : chosen) {
+        for (auto threads : threadCounts) {
+            ok = runIsolated(name, threads, ops, workloads.at(name)(threads, ops), std::cout) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../mm.h"
+
+/**
+ * Contended benchmarks work on this object: the first thread makes it before the others start, and drops it after they stop.
+ */
+static RefToObj sharedObj;
+
+static RefToObj newObj(bool threadLocal) {
+    return RefToObj::newStrong(new Object("obj", threadLocal));
+}
+
+static std::unordered_set<std::string> varNames(int64_t count) {
+    std::unordered_set<std::string> names;
+    for (int64_t i = 0; i < count; ++i) {
+        names.insert("var_" + std::to_string(i));
+    }
+    return names;
+}
+
+static void BM_IncDec(benchmark::State & state, bool threadLocal) {
+    auto obj = newObj(threadLocal);
+    for (auto _ : state) {
+        obj.get()->incCounter();
+        obj.get()->decCounter();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_IncDec, local, true);
+BENCHMARK_CAPTURE(BM_IncDec, shared, false)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_IncDecContended(benchmark::State & state, bool inflated) {
+    if (state.thread_index() == 0) {
+        sharedObj = newObj(false);
+        if (inflated) {
+            sharedObj.get()->inflate();
+        }
+    }
+    for (auto _ : state) {
+        sharedObj.get()->incCounter();
+        sharedObj.get()->decCounter();
+    }
+    if (state.thread_index() == 0) {
+        sharedObj = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_IncDecContended, adaptive, false)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_CAPTURE(BM_IncDecContended, inflated, true)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_MakeStrong(benchmark::State & state) {
+    if (state.thread_index() == 0) {
+        sharedObj = newObj(false);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(RefToObj::makeStrong(sharedObj));
+    }
+    if (state.thread_index() == 0) {
+        sharedObj = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MakeStrong)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_MakeWeak(benchmark::State & state) {
+    if (state.thread_index() == 0) {
+        sharedObj = newObj(false);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(RefToObj::makeWeak(sharedObj));
+    }
+    if (state.thread_index() == 0) {
+        sharedObj = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MakeWeak)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_WeakGet(benchmark::State & state) {
+    auto obj = newObj(false);
+    auto weak = RefToObj::makeWeak(obj);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(weak.get());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WeakGet);
+
+/**
+ * Drops the only strong reference to an object while another thread keeps upgrading a weak one,
+ * until the upgrades see the object collected.
+ */
+static void BM_UpgradeRacingDeath(benchmark::State & state) {
+    std::atomic<RefToObj const *> pending = nullptr;
+    std::atomic<bool> done = false;
+    uint64_t upgrades = 0;
+    std::thread upgrader([&]() {
+        while (!done.load(std::memory_order_acquire)) {
+            auto weak = pending.load(std::memory_order_acquire);
+            if (weak == nullptr) {
+                std::this_thread::yield();
+                continue;
+            }
+            while (!RefToObj::upgrade(*weak).isEmpty()) {
+                upgrades += 1;
+            }
+            pending.store(nullptr, std::memory_order_release);
+        }
+    });
+    for (auto _ : state) {
+        auto obj = newObj(false);
+        auto weak = RefToObj::makeWeak(obj);
+        pending.store(&weak, std::memory_order_release);
+        obj = RefToObj();
+        while (pending.load(std::memory_order_acquire) != nullptr) {
+            std::this_thread::yield();
+        }
+    }
+    done.store(true, std::memory_order_release);
+    upgrader.join();
+    state.counters["upgrades"] = benchmark::Counter(static_cast<double>(upgrades), benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UpgradeRacingDeath)->UseRealTime();
+
+/**
+ * Every thread stores its own value into the same field of the shared object and reads it back.
+ */
+static void BM_FieldsPutGet(benchmark::State & state) {
+    if (state.thread_index() == 0) {
+        sharedObj = newObj(false);
+    }
+    auto value = newObj(false);
+    for (auto _ : state) {
+        sharedObj.get()->getFields().put("field", RefToObj::makeStrong(value));
+        benchmark::DoNotOptimize(sharedObj.get()->getFields().get("field"));
+    }
+    if (state.thread_index() == 0) {
+        sharedObj = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FieldsPutGet)->ThreadRange(1, 8)->UseRealTime();
+
+/**
+ * Every thread reads the same field of the shared object, without locking if the object is frozen.
+ */
+static void BM_FieldsBorrow(benchmark::State & state, bool frozen) {
+    if (state.thread_index() == 0) {
+        sharedObj = newObj(false);
+        sharedObj.get()->getFields().put("field", newObj(false));
+        if (frozen) {
+            sharedObj.get()->getFields().freeze();
+        }
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sharedObj.get()->getFields().borrow("field"));
+    }
+    if (state.thread_index() == 0) {
+        sharedObj = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_FieldsBorrow, locked, false)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_CAPTURE(BM_FieldsBorrow, frozen, true)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_GlobalsPutGet(benchmark::State & state) {
+    Globals globals({"var"});
+    auto value = newObj(true);
+    for (auto _ : state) {
+        globals.put("var", RefToObj::makeStrong(value));
+        benchmark::DoNotOptimize(globals.get("var"));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GlobalsPutGet);
+
+/**
+ * What starting a thread costs the interpreter, for a thread capturing `range(0)` globals.
+ */
+static void BM_SpawnGlobals(benchmark::State & state) {
+    auto names = varNames(state.range(0));
+    Globals globals(names);
+    for (auto & name : names) {
+        globals.put(name, newObj(true));
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(globals.makeSubsetInitIfNeeded(names));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpawnGlobals)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+/**
+ * What counting an operation adds to it.
+ */
+static void BM_CountOp(benchmark::State & state) {
+    for (auto _ : state) {
+        OpStats::count(OpStats::StrongInc);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CountOp)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_AllocFree(benchmark::State & state, bool threadLocal) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(newObj(threadLocal));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_AllocFree, local, true)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_CAPTURE(BM_AllocFree, shared, false)->ThreadRange(1, 8)->UseRealTime();
+
+/**
+ * Freeing the head of a chain of `range(0)` objects tears the whole chain down.
+ */
+static void BM_FreeChain(benchmark::State & state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto head = newObj(true);
+        auto tail = RefToObj::makeStrong(head);
+        for (int64_t i = 1; i < state.range(0); ++i) {
+            auto next = newObj(true);
+            tail.get()->getFields().put("next", RefToObj::makeStrong(next));
+            tail = std::move(next);
+        }
+        tail = RefToObj();
+        state.ResumeTiming();
+        head = RefToObj();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FreeChain)->Arg(1000);
@@ -0,0 +1,61 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "../preparation.h"
+#include "../tests/helper.h"
+
+/**
+ * A straight-line script of `size` statements, building a chain of objects.
+ */
+static std::string straightScript(int64_t size) {
+    std::stringstream buf;
+    buf << "v_0 = object" << std::endl;
+    for (int64_t i = 1; i < size; ++i) {
+        if (i % 3 == 0) {
+            buf << "dump v_" << i - 1 << std::endl;
+        } else if (i % 3 == 1) {
+            buf << "v_" << i << " = object" << std::endl;
+        } else {
+            buf << "v_" << i - 1 << ".prev = v_" << std::max<int64_t>(i - 4, 0) << std::endl;
+        }
+    }
+    return buf.str();
+}
+
+/**
+ * A loop running `size` statements in total.
+ */
+static std::string loopScript(int64_t size) {
+    std::stringstream buf;
+    buf << "shared = object" << std::endl;
+    buf << "repeat " << size / 4 << " i {" << std::endl;
+    buf << "    tmp_$i = object" << std::endl;
+    buf << "    tmp_$i.shared = shared" << std::endl;
+    buf << "    keep_$i ~= tmp_$i" << std::endl;
+    buf << "    dump keep_$i" << std::endl;
+    buf << "}" << std::endl;
+    return buf.str();
+}
+
+static void benchPreprocess(benchmark::State & state, std::string const & script) {
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    for (auto _ : state) {
+        state.PauseTiming();
+        statements = parse(script); // the previous program is freed here too, off the clock
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(preprocess(statements));
+    }
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_PreprocessStraight(benchmark::State & state) {
+    benchPreprocess(state, straightScript(state.range(0)));
+}
+BENCHMARK(BM_PreprocessStraight)->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMillisecond)->Complexity();
+
+static void BM_PreprocessLoop(benchmark::State & state) {
+    benchPreprocess(state, loopScript(state.range(0)));
+}
+BENCHMARK(BM_PreprocessLoop)->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMillisecond)->Complexity();
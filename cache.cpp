@@ -0,0 +1,577 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "preparation.h"
+
+/*
+ * The layout of a compiled program:
+ * Header | code | names
+ * The code holds the statements in pre-order, each starting with its `Tag`, followed by the names of the globals.
+ * All the numbers in it are varints, 7 bits per byte, the lowest first, and a name is its index in `names`.
+ * Each name is stored once in `names`, as its varint length followed by its characters.
+ */
+
+static char const MAGIC[8] = {'A', 'R', 'C', 'P', 'R', 'G', '0', '6'};
+
+struct Header {
+    char magic[8]; // of the file format
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint32_t preparation; // `PREPARATION_VERSION` of the compiler which prepared the program
+    uint32_t workers;
+    uint32_t statements;
+    uint32_t globals;
+    uint32_t names;
+    uint64_t codeSize;
+    uint64_t namesSize;
+};
+
+enum class Tag : uint8_t {
+    Assign,
+    EndOfLife,
+    NewThread,
+    Repeat,
+    Join,
+    Checkpoint,
+    Sleep,
+    Sleepr,
+    Dump,
+    Stats,
+    Freeze,
+    Parallel,
+    NewObject,
+    Var,
+    SelectField,
+};
+
+namespace {
+    /**
+     * The file is not a compiled program, or not a whole one.
+     */
+    class Corrupted : public std::exception {};
+}
+
+class ProgramWriter : public ast::Statement::Visitor, public ast::Expression::Visitor {
+public:
+    void statements(std::vector<std::unique_ptr<ast::Statement>> const & stats) {
+        for (auto & stat : stats) {
+            stat->accept(*this);
+        }
+    }
+
+    void names(std::unordered_set<std::string> const & set) {
+        number(set.size());
+        for (auto & name : set) {
+            this->name(name);
+        }
+    }
+
+    void write(std::string const & path, Header header) const {
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.preparation = PREPARATION_VERSION;
+        header.names = nameIds.size();
+        header.codeSize = code.size();
+        header.namesSize = namesBuf.size();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write((char const *) &header, sizeof(header));
+        file.write(code.data(), (std::streamsize) code.size());
+        file.write(namesBuf.data(), (std::streamsize) namesBuf.size());
+        file.close();
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+
+    void visitAssign(ast::Assign & assign) override {
+        tag(Tag::Assign);
+        number(assign.isWeak);
+        assign.to->accept(*this);
+        assign.from->accept(*this);
+    }
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {
+        tag(Tag::EndOfLife);
+        name(endOfLife.varName);
+    }
+
+    void visitNewThread(ast::NewThread & newThread) override {
+        tag(Tag::NewThread);
+        name(newThread.handle);
+        // a shared body is written once, the next threads refer to the first one
+        auto [first, added] = threadIds.emplace(newThread.body.get(), threadIds.size());
+        if (!added) {
+            number(first->second + 1);
+            return;
+        }
+        number(0);
+        number(newThread.body->size());
+        statements(*newThread.body);
+        names(*newThread.usedVars);
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        tag(Tag::Repeat);
+        number(repeat.times);
+        name(repeat.counter);
+        number(repeat.body.size());
+        statements(repeat.body);
+    }
+
+    void visitJoin(ast::Join & join) override {
+        tag(Tag::Join);
+        name(join.handle);
+    }
+
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override {
+        tag(Tag::Checkpoint);
+        name(checkpoint.path);
+    }
+
+    void visitSleep(ast::Sleep & sleep) override {
+        tag(Tag::Sleep);
+    }
+
+    void visitSleepr(ast::Sleepr & sleepr) override {
+        tag(Tag::Sleepr);
+    }
+
+    void visitStats(ast::Stats & stats) override {
+        tag(Tag::Stats);
+    }
+
+    void visitDump(ast::Dump & dump) override {
+        tag(Tag::Dump);
+        dump.expr->accept(*this);
+    }
+
+    void visitFreeze(ast::Freeze & freeze) override {
+        tag(Tag::Freeze);
+        freeze.expr->accept(*this);
+    }
+
+    void visitParallel(ast::Parallel & parallel) override {
+        tag(Tag::Parallel);
+        number(parallel.body.size());
+        statements(parallel.body);
+        number(parallel.groups.size());
+        for (auto & group : parallel.groups) {
+            number(group.size());
+            for (auto & part : group) {
+                number(part.stat);
+                number(part.begin);
+                number(part.end);
+            }
+        }
+        names(parallel.usedVars);
+    }
+
+    void visitNewObject(ast::NewObject & newObject) override {
+        tag(Tag::NewObject);
+        name(newObject.name);
+        number(newObject.threadLocal);
+    }
+
+    void visitVar(ast::Var & var) override {
+        tag(Tag::Var);
+        name(var.name);
+    }
+
+    void visitSelectField(ast::SelectField & selectField) override {
+        tag(Tag::SelectField);
+        selectField.obj->accept(*this);
+        name(selectField.name);
+    }
+private:
+    std::string code;
+    std::string namesBuf;
+    std::unordered_map<std::string_view, uint32_t> nameIds; // views into the nodes
+    std::unordered_map<void const *, uint32_t> threadIds; // by body, in the order of the first appearance
+
+    static void append(std::string & buf, std::size_t value) {
+        for (; value >= 0x80; value >>= 7) {
+            buf += static_cast<char>(value & 0x7f | 0x80);
+        }
+        buf += static_cast<char>(value);
+    }
+
+    void number(std::size_t value) {
+        append(code, value);
+    }
+
+    void tag(Tag value) {
+        number(static_cast<uint8_t>(value));
+    }
+
+    void name(std::string const & value) {
+        auto [found, added] = nameIds.emplace(value, nameIds.size());
+        if (added) {
+            append(namesBuf, value.size());
+            namesBuf += value;
+        }
+        number(found->second);
+    }
+};
+
+/**
+ * Builds the nodes back from the code of a mapped file, checking every number against the bounds of the file.
+ */
+class ProgramReader {
+public:
+    ProgramReader(char const * code, std::size_t codeSize, char const * namesBuf, std::size_t namesSize, std::size_t names)
+            : code(code)
+            , size(codeSize) {
+        // the names are looked up by index, so they are indexed first
+        ProgramReader lengths(namesBuf, namesSize);
+        for (std::size_t i = 0; i < names; ++i) {
+            auto length = lengths.number();
+            if (length > namesSize - lengths.pos) {
+                throw Corrupted();
+            }
+            table.emplace_back(namesBuf + lengths.pos, length);
+            lengths.pos += length;
+        }
+    }
+
+    std::vector<std::unique_ptr<ast::Statement>> statements(std::size_t number) {
+        std::vector<std::unique_ptr<ast::Statement>> result;
+        // each statement takes a byte at least
+        if (number > size - pos) {
+            throw Corrupted();
+        }
+        result.reserve(number);
+        for (std::size_t i = 0; i < number; ++i) {
+            result.push_back(statement());
+        }
+        return result;
+    }
+
+    std::unordered_set<std::string> names() {
+        std::unordered_set<std::string> result;
+        for (auto left = count(); left > 0; --left) {
+            result.insert(name());
+        }
+        return result;
+    }
+
+    [[nodiscard]] bool atEnd() const {
+        return pos == size;
+    }
+private:
+    ProgramReader(char const * code, std::size_t size) : code(code), size(size) {}
+
+    char const * const code;
+    std::size_t const size;
+    std::size_t pos = 0;
+    std::vector<std::string_view> table; // views into the mapped file
+    std::vector<ast::NewThread *> threads; // with distinct bodies, in the order of appearance
+
+    uint64_t number() {
+        uint64_t result = 0;
+        for (uint shift = 0; shift < 64; shift += 7) {
+            if (pos == size) {
+                throw Corrupted();
+            }
+            auto byte = static_cast<uint8_t>(code[pos++]);
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return result;
+            }
+        }
+        throw Corrupted();
+    }
+
+    /**
+     * The number of items which follow, each taking a byte at least.
+     */
+    std::size_t count() {
+        auto result = number();
+        if (result > size - pos) {
+            throw Corrupted();
+        }
+        return result;
+    }
+
+    [[nodiscard]] Tag peek() const {
+        if (pos == size) {
+            throw Corrupted();
+        }
+        return static_cast<Tag>(code[pos]);
+    }
+
+    std::string name() {
+        auto id = number();
+        if (id >= table.size()) {
+            throw Corrupted();
+        }
+        return std::string(table[id]);
+    }
+
+    std::unique_ptr<ast::Statement> statement() {
+        switch (static_cast<Tag>(number())) {
+            case Tag::Assign: {
+                bool isWeak = number() != 0;
+                auto to = assignableTo();
+                auto from = expression();
+                return std::make_unique<ast::Assign>(std::move(to), std::move(from), isWeak);
+            }
+            case Tag::EndOfLife:
+                return std::make_unique<ast::EndOfLife>(name());
+            case Tag::NewThread: {
+                auto handle = name();
+                auto sameAs = number();
+                if (sameAs > threads.size()) {
+                    throw Corrupted();
+                } else if (sameAs > 0) {
+                    auto newThread = std::make_unique<ast::NewThread>(handle, std::vector<std::unique_ptr<ast::Statement>>());
+                    newThread->body = threads[sameAs - 1]->body;
+                    newThread->usedVars = threads[sameAs - 1]->usedVars;
+                    return newThread;
+                }
+                auto body = statements(number());
+                auto newThread = std::make_unique<ast::NewThread>(handle, std::move(body));
+                *newThread->usedVars = names();
+                threads.push_back(newThread.get());
+                return newThread;
+            }
+            case Tag::Repeat: {
+                auto times = number();
+                auto counter = name();
+                auto body = statements(number());
+                return std::make_unique<ast::Repeat>(times, counter, std::move(body));
+            }
+            case Tag::Join:
+                return std::make_unique<ast::Join>(name());
+            case Tag::Checkpoint:
+                return std::make_unique<ast::Checkpoint>(name());
+            case Tag::Sleep:
+                return std::make_unique<ast::Sleep>();
+            case Tag::Sleepr:
+                return std::make_unique<ast::Sleepr>();
+            case Tag::Dump:
+                return std::make_unique<ast::Dump>(expression());
+            case Tag::Stats:
+                return std::make_unique<ast::Stats>();
+            case Tag::Freeze:
+                return std::make_unique<ast::Freeze>(expression());
+            case Tag::Parallel: {
+                auto body = statements(number());
+                std::vector<std::vector<ast::Parallel::Part>> groups(count());
+                for (auto & group : groups) {
+                    group.resize(count());
+                    for (auto & part : group) {
+                        part.stat = number();
+                        part.begin = number();
+                        part.end = number();
+                        if (part.stat >= body.size()) {
+                            throw Corrupted();
+                        }
+                    }
+                }
+                auto usedVars = names();
+                return std::make_unique<ast::Parallel>(std::move(body), std::move(groups), std::move(usedVars));
+            }
+            default:
+                throw Corrupted();
+        }
+    }
+
+    std::unique_ptr<ast::Expression> expression() {
+        if (peek() == Tag::NewObject) {
+            number();
+            auto newObject = std::make_unique<ast::NewObject>(name());
+            newObject->threadLocal = number() != 0;
+            return newObject;
+        }
+        return assignableTo();
+    }
+
+    std::unique_ptr<ast::AssignableTo> assignableTo() {
+        switch (static_cast<Tag>(number())) {
+            case Tag::Var:
+                return std::make_unique<ast::Var>(name());
+            case Tag::SelectField: {
+                auto obj = assignableTo();
+                return std::make_unique<ast::SelectField>(std::move(obj), name());
+            }
+            default:
+                throw Corrupted();
+        }
+    }
+};
+
+/**
+ * A read-only mapping of a whole file, empty if the file can't be mapped.
+ */
+class MappedProgram {
+public:
+    explicit MappedProgram(std::string const & path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+        }
+    }
+
+    MappedProgram(MappedProgram const & that) = delete;
+    MappedProgram & operator =(MappedProgram const & that) = delete;
+
+    ~MappedProgram() {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+    }
+
+    void * data = nullptr;
+    std::size_t size = 0;
+};
+
+ScriptCache::ScriptCache(std::string dir, std::uintmax_t maxBytes) : dir(std::move(dir)), maxBytes(maxBytes) {}
+
+std::string ScriptCache::defaultDir() {
+    if (auto dir = std::getenv("ARC_CACHE_DIR")) {
+        return dir;
+    }
+    if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+        return std::string(xdg) + "/arc";
+    }
+    if (auto home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+        return std::string(home) + "/.cache/arc";
+    }
+    return "";
+}
+
+uint64_t ScriptCache::hash(std::string const & source) {
+    uint64_t result = 14695981039346656037ull;
+    for (unsigned char c : source) {
+        result ^= c;
+        result *= 1099511628211ull;
+    }
+    return result;
+}
+
+std::string ScriptCache::path(uint64_t sourceHash) const {
+    std::stringstream buf;
+    buf << dir << "/" << std::hex << sourceHash << ".arcc";
+    return buf.str();
+}
+
+bool ScriptCache::load(std::string const & source, uint workers, ParsedProgram & program, std::unordered_set<std::string> & globalNames) const {
+    if (dir.empty()) {
+        return false;
+    }
+    auto sourceHash = hash(source);
+    MappedProgram file(path(sourceHash));
+    auto header = static_cast<Header const *>(file.data);
+    if (file.size < sizeof(Header) || std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+            || header->preparation != PREPARATION_VERSION
+            || header->sourceHash != sourceHash || header->sourceSize != source.size() || header->workers != workers
+            || header->codeSize > file.size - sizeof(Header) || header->namesSize != file.size - sizeof(Header) - header->codeSize) {
+        return false;
+    }
+    auto code = reinterpret_cast<char const *>(header + 1);
+    program.arenas.push_back(std::make_unique<ast::Arena>());
+    try {
+        ProgramReader reader(code, header->codeSize, code + header->codeSize, header->namesSize, header->names);
+        ast::Arena::Scope scope(*program.arenas.back());
+        program.statements = reader.statements(header->statements);
+        globalNames = reader.names();
+        if (!reader.atEnd() || globalNames.size() != header->globals) {
+            throw Corrupted();
+        }
+    } catch (Corrupted &) {
+        program.statements.clear();
+        globalNames.clear();
+        return false;
+    }
+    // the least recently used programs are evicted first
+    std::error_code ignored;
+    std::filesystem::last_write_time(path(sourceHash), std::filesystem::file_time_type::clock::now(), ignored);
+    std::stringstream buf;
+    buf << "Loaded compiled program " << path(sourceHash) << std::endl;
+    log(buf);
+    return true;
+}
+
+void ScriptCache::save(std::string const & source, uint workers, ParsedProgram const & program, std::unordered_set<std::string> const & globalNames) const {
+    if (dir.empty()) {
+        return;
+    }
+    ProgramWriter writer;
+    writer.statements(program.statements);
+    writer.names(globalNames);
+
+    Header header{};
+    header.sourceHash = hash(source);
+    header.sourceSize = source.size();
+    header.workers = workers;
+    header.statements = program.statements.size();
+    header.globals = globalNames.size();
+    auto target = path(header.sourceHash);
+    // written aside and renamed, so concurrent runs never see a half-written file
+    std::stringstream temp;
+    temp << target << "." << getpid() << "." << std::this_thread::get_id();
+    try {
+        std::filesystem::create_directories(dir);
+        writer.write(temp.str(), header);
+        std::filesystem::rename(temp.str(), target);
+        evict(target);
+    } catch (std::exception & ex) {
+        std::error_code ignored;
+        std::filesystem::remove(temp.str(), ignored);
+        log("Could not cache the compiled program: " + std::string(ex.what()));
+        return;
+    }
+    std::stringstream buf;
+    buf << "Saved compiled program " << target << std::endl;
+    log(buf);
+}
+
+void ScriptCache::evict(std::string const & kept) const {
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+    std::uintmax_t total = 0;
+    for (auto & entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() != ".arcc" || !entry.is_regular_file()) {
+            continue;
+        }
+        total += entry.file_size();
+        if (entry.path().filename() != std::filesystem::path(kept).filename()) {
+            files.emplace_back(entry.last_write_time(), entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    for (auto & [time, file] : files) {
+        if (total <= maxBytes) {
+            break;
+        }
+        auto size = std::filesystem::file_size(file);
+        if (std::filesystem::remove(file)) {
+            total -= size;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+#include "parsing/parallel.h"
+
+/**
+ * Compiled programs, i.e. parsed and prepared ones, saved on disk to skip the front end when a script runs again.
+ * A program is saved in a compact binary form, into a file named after a hash of its source,
+ * and is taken from there only for the same source, the same number of workers and the same preparation it was prepared with.
+ * The directory is kept under `maxBytes`, the least recently used programs are removed first.
+ */
+class ScriptCache {
+public:
+    static std::uintmax_t const DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+    explicit ScriptCache(std::string dir, std::uintmax_t maxBytes = DEFAULT_MAX_BYTES);
+
+    /**
+     * `$ARC_CACHE_DIR`, `$XDG_CACHE_HOME/arc` or `~/.cache/arc`, whichever is set first.
+     * Empty if the cache is off, e.g. `ARC_CACHE_DIR` is set to an empty string.
+     */
+    static std::string defaultDir();
+
+    /**
+     * FNV-1a, 64 bits.
+     */
+    static uint64_t hash(std::string const & source);
+
+    /**
+     * Maps the compiled program from the cache, if it's there and fresh.
+     * @return false if it's not, the program is left empty then.
+     */
+    bool load(std::string const & source, uint workers, ParsedProgram & program, std::unordered_set<std::string> & globalNames) const;
+
+    /**
+     * Failures are not errors, the program is just compiled once more next time.
+     */
+    void save(std::string const & source, uint workers, ParsedProgram const & program, std::unordered_set<std::string> const & globalNames) const;
+private:
+    [[nodiscard]] std::string path(uint64_t sourceHash) const;
+    /**
+     * Removes the least recently used programs but `kept` until the directory fits into `maxBytes`.
+     */
+    void evict(std::string const & kept) const;
+
+    std::string const dir;
+    std::uintmax_t const maxBytes;
+};
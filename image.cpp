@@ -0,0 +1,308 @@
+#include "image.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+/*
+ * The layout of an image:
+ * Header | ObjectRecord[objects] | NamedRef[fields] | NamedRef[globals] | names
+ */
+
+static char const MAGIC[8] = {'A', 'R', 'C', 'I', 'M', 'G', '0', '2'};
+
+struct Header {
+    char magic[8];
+    uint32_t objects;
+    uint32_t fields;
+    uint32_t globals;
+    uint32_t collectedProxies; // proxies of the weak references to already collected objects
+    uint64_t namesSize;
+};
+
+enum class RefKind : uint32_t {
+    Strong,
+    Weak,
+    WeakToCollected, // `target` is an index of a proxy rather than of an object
+};
+
+struct NamedRef {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    RefKind kind;
+    uint32_t target;
+};
+
+struct ObjectRecord {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t firstField;
+    uint32_t fieldCount;
+    uint32_t frozen;
+};
+
+ImageError::ImageError(std::string const & path, std::string const & reason) {
+    std::stringstream buf;
+    buf << "heap image \"" << path << "\": " << reason;
+    descr = buf.str();
+}
+
+char const * ImageError::what() const noexcept {
+    return descr.c_str();
+}
+
+/**
+ * Numbers the objects in the order of a breadth-first traversal from the variables.
+ */
+class ImageWriter {
+public:
+    explicit ImageWriter(Globals const & globals) {
+        for (auto & [name, ref] : globals.getMap()) {
+            globalRecords.push_back(namedRef(name, ref));
+        }
+        // `objects` grows while the fields are being numbered
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            auto fields = objects[i]->getFields().getMap();
+            objectRecords[i].firstField = fieldRecords.size();
+            objectRecords[i].fieldCount = fields.size();
+            for (auto & [name, ref] : fields) {
+                auto field = namedRef(name, ref); // may number new objects
+                fieldRecords.push_back(field);
+            }
+        }
+    }
+
+    void write(std::string const & path) const {
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.objects = objectRecords.size();
+        header.fields = fieldRecords.size();
+        header.globals = globalRecords.size();
+        header.collectedProxies = collectedProxies.size();
+        header.namesSize = names.size();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write((char const *) &header, sizeof(header));
+        file.write((char const *) objectRecords.data(), (std::streamsize) (objectRecords.size() * sizeof(ObjectRecord)));
+        file.write((char const *) fieldRecords.data(), (std::streamsize) (fieldRecords.size() * sizeof(NamedRef)));
+        file.write((char const *) globalRecords.data(), (std::streamsize) (globalRecords.size() * sizeof(NamedRef)));
+        file.write(names.data(), (std::streamsize) names.size());
+        file.close();
+        if (!file) {
+            throw ImageError(path, "can not be written");
+        }
+    }
+private:
+    std::vector<RefToObj> objects; // strong references, keeping the objects alive while they are written
+    std::unordered_map<Object *, uint32_t> objectIds;
+    std::unordered_map<Collectible *, uint32_t> collectedProxies;
+    std::vector<ObjectRecord> objectRecords;
+    std::vector<NamedRef> fieldRecords;
+    std::vector<NamedRef> globalRecords;
+    std::string names;
+
+    NamedRef namedRef(std::string const & name, RefToObj const & ref) {
+        NamedRef result{};
+        result.nameOffset = names.size();
+        result.nameLength = name.size();
+        names += name;
+
+        Object * obj = nullptr;
+        try {
+            obj = ref.get();
+        } catch (WeakRef::InvalidAccess & ex) {
+            auto [proxy, _] = collectedProxies.emplace(ref.getRaw(), collectedProxies.size());
+            result.kind = RefKind::WeakToCollected;
+            result.target = proxy->second;
+            return result;
+        }
+        result.kind = ref.isWeak() ? RefKind::Weak : RefKind::Strong;
+        result.target = objectId(obj, ref);
+        return result;
+    }
+
+    uint32_t objectId(Object * obj, RefToObj const & ref) {
+        auto found = objectIds.find(obj);
+        if (found != objectIds.end()) {
+            return found->second;
+        }
+        uint32_t id = objects.size();
+        objectIds.emplace(obj, id);
+        objects.push_back(RefToObj::makeStrong(ref));
+        ObjectRecord record{};
+        record.nameOffset = names.size();
+        record.nameLength = obj->getName().size();
+        names += obj->getName();
+        record.frozen = obj->getFields().isFrozen();
+        objectRecords.push_back(record);
+        return id;
+    }
+};
+
+void saveImage(Globals const & globals, std::string const & path) {
+    ImageWriter(globals).write(path);
+    std::stringstream buf;
+    buf << "Saved heap image " << path << std::endl;
+    log(buf);
+}
+
+/**
+ * A read-only mapping of a whole file.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(std::string const & path) : path(path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw ImageError(path, std::strerror(errno));
+        }
+        struct stat st{};
+        if (fstat(fd, &st) < 0) {
+            auto error = errno;
+            close(fd);
+            throw ImageError(path, std::strerror(error));
+        }
+        size = st.st_size;
+        data = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        auto error = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw ImageError(path, std::strerror(error));
+        }
+    }
+
+    MappedFile(MappedFile const & that) = delete;
+    MappedFile & operator =(MappedFile const & that) = delete;
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+    }
+
+    /**
+     * `count` items of `T` at `offset`, checked to fit into the file.
+     */
+    template<typename T>
+    T const * at(std::size_t offset, std::size_t count) const {
+        if (offset > size || count > (size - offset) / sizeof(T)) {
+            throw ImageError(path, "truncated");
+        }
+        return (T const *) ((char const *) data + offset);
+    }
+private:
+    std::string path;
+    void * data = nullptr;
+    std::size_t size = 0;
+};
+
+class ImageReader {
+public:
+    ImageReader(std::string const & path, MappedFile const & file) : path(path) {
+        header = file.at<Header>(0, 1);
+        if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw ImageError(path, "not a heap image");
+        }
+        std::size_t offset = sizeof(Header);
+        objectRecords = file.at<ObjectRecord>(offset, header->objects);
+        offset += header->objects * sizeof(ObjectRecord);
+        fieldRecords = file.at<NamedRef>(offset, header->fields);
+        offset += header->fields * sizeof(NamedRef);
+        globalRecords = file.at<NamedRef>(offset, header->globals);
+        offset += header->globals * sizeof(NamedRef);
+        names = file.at<char>(offset, header->namesSize);
+    }
+
+    Globals read(std::unordered_set<std::string> const & globalNames) {
+        for (uint32_t i = 0; i < header->objects; ++i) {
+            auto & record = objectRecords[i];
+            objects.push_back(RefToObj::newStrong(new Object(name(record.nameOffset, record.nameLength), true)));
+        }
+        for (uint32_t i = 0; i < header->collectedProxies; ++i) {
+            collectedProxies.push_back(RefToObj::newWeak(new WeakRef()));
+        }
+        for (uint32_t i = 0; i < header->objects; ++i) {
+            auto & record = objectRecords[i];
+            if (record.firstField > header->fields || record.fieldCount > header->fields - record.firstField) {
+                throw ImageError(path, "corrupted fields");
+            }
+            auto & fields = objects[i]->getFields();
+            for (uint32_t j = record.firstField; j < record.firstField + record.fieldCount; ++j) {
+                auto & field = fieldRecords[j];
+                fields.put(name(field.nameOffset, field.nameLength), ref(field));
+            }
+            if (record.frozen != 0) {
+                fields.freeze();
+            }
+        }
+
+        Globals globals(globalNames);
+        for (uint32_t i = 0; i < header->globals; ++i) {
+            auto & global = globalRecords[i];
+            auto globalName = name(global.nameOffset, global.nameLength);
+            if (globalNames.count(globalName) != 0) {
+                globals.put(globalName, ref(global));
+            }
+        }
+        // now only the references from the image keep the objects alive
+        objects.clear();
+        collectedProxies.clear();
+        return globals;
+    }
+private:
+    std::string const & path;
+    Header const * header;
+    ObjectRecord const * objectRecords;
+    NamedRef const * fieldRecords;
+    NamedRef const * globalRecords;
+    char const * names;
+    std::vector<RefToObj> objects;
+    std::vector<RefToObj> collectedProxies;
+
+    std::string name(uint32_t offset, uint32_t length) const {
+        if (offset > header->namesSize || length > header->namesSize - offset) {
+            throw ImageError(path, "corrupted names");
+        }
+        return {names + offset, length};
+    }
+
+    RefToObj ref(NamedRef const & record) const {
+        switch (record.kind) {
+            case RefKind::Strong:
+                return RefToObj::makeStrong(object(record.target));
+            case RefKind::Weak:
+                return RefToObj::makeWeak(object(record.target));
+            case RefKind::WeakToCollected:
+                if (record.target >= collectedProxies.size()) {
+                    throw ImageError(path, "corrupted references");
+                }
+                return collectedProxies[record.target];
+        }
+        throw ImageError(path, "corrupted references");
+    }
+
+    RefToObj const & object(uint32_t id) const {
+        if (id >= objects.size()) {
+            throw ImageError(path, "corrupted references");
+        }
+        return objects[id];
+    }
+};
+
+Globals loadImage(std::string const & path, std::unordered_set<std::string> const & names) {
+    MappedFile file(path);
+    auto globals = ImageReader(path, file).read(names);
+    std::stringstream buf;
+    buf << "Loaded heap image " << path << std::endl;
+    log(buf);
+    return globals;
+}
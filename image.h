@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+
+#include "mm.h"
+
+/**
+ * Heap images, written by `checkpoint` and used to start a program from a saved state.
+ * An image holds the variables and all the objects they reach, with their fields and weak references.
+ * References are stored as indices, so the image does not depend on the addresses it was taken at.
+ * Reference counters are not stored: they are restored from the references themselves.
+ */
+void saveImage(Globals const & globals, std::string const & path);
+
+/**
+ * Restores the variables with the given names from the image.
+ * Variables of the image which are not among `names` are dropped.
+ */
+Globals loadImage(std::string const & path, std::unordered_set<std::string> const & names);
+
+class ImageError : public std::exception {
+public:
+    ImageError(std::string const & path, std::string const & reason);
+    [[nodiscard]] char const * what() const noexcept override;
+private:
+    std::string descr;
+};
@@ -1,48 +1,114 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <thread>
 #include <chrono>
 #include <cstdlib>
 #include <sstream>
+#include <exception>
 #include "interpreter.h"
 #include "ast.h"
 #include "logger.h"
+#include "image.h"
+#include "perf.h"
 
-Interpreter::Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, std::unordered_set<std::string> const & globalNames)
-    : prog(prog)
-    , globals(globalNames) {}
+thread_local StatementTimes * StatementTimes::current = nullptr;
 
-Interpreter::Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Globals && globals)
-    : prog(prog)
-    , globals(std::move(globals)) {}
+void StatementTimes::add(std::vector<double> const & more) {
+    std::lock_guard<std::mutex> lock(mutex);
+    micros.insert(micros.end(), more.begin(), more.end());
+}
+
+std::size_t StatementTimes::count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return micros.size();
+}
+
+double StatementTimes::quantile(double q) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (micros.empty()) {
+        return 0;
+    }
+    auto rank = std::min(static_cast<std::size_t>(std::ceil(q * micros.size())), micros.size() - 1);
+    std::nth_element(micros.begin(), micros.begin() + rank, micros.end());
+    return micros[rank];
+}
+
+Interpreter::Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, std::unordered_set<std::string> const & globalNames, Output & output)
+    : ownGlobals(globalNames)
+    , prog(prog)
+    , globals(ownGlobals)
+    , output(output)
+    , times(StatementTimes::current) {}
+
+Interpreter::Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Globals && globals, Output & output)
+    : ownGlobals(std::move(globals))
+    , prog(prog)
+    , globals(ownGlobals)
+    , output(output)
+    , times(StatementTimes::current) {}
+
+Interpreter::Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Interpreter & parent)
+    : ownGlobals(std::unordered_set<std::string>())
+    , prog(prog)
+    , globals(parent.globals)
+    , output(parent.output.getOutput())
+    , times(parent.times) {}
 
 void Interpreter::interpret() {
     for (auto & elem: prog) {
         interpret(elem);
     }
+    finish();
+}
 
+void Interpreter::finish() {
     for (auto & thread : subThreads) {
-        thread.join();
+        if (thread.joinable()) {
+            thread.join();
+        }
     }
+    output.submit();
 }
 
 void Interpreter::interpret(std::unique_ptr<ast::Statement> const & stat) {
-    std::stringstream buf;
-    stat->print(buf);
-    buf << std::endl;
-    log(buf);
+    if (ENABLED) {
+        std::stringstream buf;
+        stat->print(buf);
+        buf << std::endl;
+        log(buf);
+    }
 
+    if (times == nullptr) {
+        stat->accept(*this);
+        return;
+    }
+    auto runBefore = statementsRun;
+    auto start = std::chrono::steady_clock::now();
     stat->accept(*this);
+    auto finish = std::chrono::steady_clock::now();
+    if (statementsRun == runBefore) {
+        statementMicros.push_back(std::chrono::duration<double, std::micro>(finish - start).count());
+    }
+    statementsRun += 1;
+}
+
+std::string const & Interpreter::expand(std::string const & name, std::string & buf) const {
+    if (counters.empty() || name.find('$') == std::string::npos) {
+        return name;
+    }
+    buf = ast::Repeat::expand(name, counters);
+    return buf;
 }
 
 void Interpreter::visitAssign(ast::Assign & assign) {
     auto evaluator = Evaluator(*this, *assign.from);
-    auto & obj = evaluator.eval();
 
     RefToObj ref;
     if (assign.isWeak) {
-        ref = std::move(RefToObj::makeWeak(obj));
+        ref = std::move(RefToObj::makeWeak(evaluator.eval()));
     } else {
-        ref = std::move(RefToObj::makeStrong(obj));
+        ref = std::move(evaluator.takeStrong());
     }
     auto resolver = AssignableResolver(*this, *assign.to);
     resolver.scope().put(resolver.name(), std::move(ref));
@@ -50,17 +116,76 @@ void Interpreter::visitAssign(ast::Assign & assign) {
 
 void Interpreter::visitNewThread(ast::NewThread & astNewThread) {
     log("Starting new thread");
-    auto usedGlobals = globals.makeSubsetInitIfNeeded(astNewThread.usedVars);
-    auto threadInterpreter = new Interpreter(astNewThread.body, std::move(usedGlobals));
+    auto usedGlobals = [&]() {
+        if (counters.empty()) {
+            return globals.makeSubsetInitIfNeeded(*astNewThread.usedVars);
+        }
+        std::unordered_set<std::string> usedVars;
+        for (auto & var : *astNewThread.usedVars) {
+            usedVars.insert(ast::Repeat::expand(var, counters));
+        }
+        return globals.makeSubsetInitIfNeeded(usedVars);
+    }();
+    auto threadInterpreter = new Interpreter(*astNewThread.body, std::move(usedGlobals), output.getOutput());
+    threadInterpreter->counters = counters;
+    threadInterpreter->times = times;
 
-    auto thread = std::thread([this, & astNewThread, threadInterpreter](){
+    auto thread = std::thread([this, & astNewThread, threadInterpreter, heapStats = HeapStats::current, perf = PerfReport::current](){
+        HeapStats::current = heapStats;
+        PerfReport::current = perf;
+        ThreadPerf threadPerf;
         threadInterpreter->interpret();
         delete threadInterpreter;
         log("Finished a thread");
     });
+    if (!astNewThread.handle.empty()) {
+        std::string buf;
+        threadHandles[expand(astNewThread.handle, buf)] = subThreads.size();
+    }
     subThreads.push_back(std::move(thread));
 }
 
+void Interpreter::visitRepeat(ast::Repeat & repeat) {
+    runIterations(repeat, 0, repeat.times);
+}
+
+void Interpreter::runIterations(ast::Repeat & repeat, uint begin, uint end) {
+    counters.emplace_back(repeat.counter, 0);
+    for (uint i = begin; i < end; ++i) {
+        counters.back().second = i;
+        for (auto & stat : repeat.body) {
+            interpret(stat);
+        }
+    }
+    counters.pop_back();
+}
+
+void Interpreter::visitJoin(ast::Join & join) {
+    if (join.handle.empty()) {
+        for (auto & thread : subThreads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        return;
+    }
+
+    std::string buf;
+    auto & handle = expand(join.handle, buf);
+    auto found = threadHandles.find(handle);
+    if (found == threadHandles.end()) {
+        throw Scope::NoSuchVar("thread", handle);
+    }
+    auto & thread = subThreads[found->second];
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Interpreter::visitCheckpoint(ast::Checkpoint & checkpoint) {
+    saveImage(globals, checkpoint.path);
+}
+
 void Interpreter::visitSleep(ast::Sleep & sleep) {
     using namespace std::chrono_literals;
     // TODO maybe its not the interpreter who sets the delay size
@@ -103,22 +228,31 @@ void Interpreter::visitDump(ast::Dump & dump) {
         } else {
             buf << "obj ";
         }
-        // actual counter is +1 greater than an external observer would expect due to `obj` being a reference itself
-        buf << "refCounter = " << ref.getRaw()->getRefCounter() - 1 << ", ";
+        // an owned result is a reference itself, so its counter is +1 greater than an external observer would expect
+        auto ownRefs = evaluator.isOwned() ? 1 : 0;
+        buf << "refCounter = " << ref.getRaw()->getRefCounter() - ownRefs << ", ";
 
+        // the referent of a weak reference is anchored while it's dumped
+        RefToObj upgraded;
         Object * obj = nullptr;
-        try {
+        if (ref.isWeak()) {
+            upgraded = RefToObj::upgrade(ref);
+            obj = upgraded.isEmpty() ? nullptr : upgraded.get();
+        } else {
             obj = ref.get();
-        } catch (WeakRef::InvalidAccess & ex) {
-            buf << "obj collected" << std::endl;
         }
 
-        if (obj != nullptr) {
+        if (obj == nullptr) {
+            buf << "obj collected" << std::endl;
+        } else {
             if (ref.isWeak()) {
-                buf << "obj refCounter = " << ref->getRefCounter() << ", ";
+                buf << "obj refCounter = " << obj->getRefCounter() - 1 << ", ";
             }
 
-            auto fields = ref->getFields().getMap();
+            if (obj->getFields().isFrozen()) {
+                buf << "frozen, ";
+            }
+            auto fields = obj->getFields().getMap();
             buf << "fields = {";
             bool first = true;
             for (auto &[name, refInField]: fields) {
@@ -131,28 +265,111 @@ void Interpreter::visitDump(ast::Dump & dump) {
             buf << "}" << std::endl;
         }
     }
-    std::cout << buf.str();
+    output.write(buf.str());
+}
+
+void Interpreter::visitStats(ast::Stats & stats) {
+    std::stringstream buf;
+    stats.print(buf);
+    buf << ": ";
+    OpStats::print(OpStats::total(), buf);
+    buf << std::endl;
+    output.write(buf.str());
+}
+
+void Interpreter::visitFreeze(ast::Freeze & freeze) {
+    auto evaluator = Evaluator(*this, *freeze.expr);
+    evaluator.evalObject()->getFields().freeze();
 }
 
 void Interpreter::visitEndOfLife(ast::EndOfLife & endOfLife) {
-    globals.erase(endOfLife.varName);
+    std::string buf;
+    globals.erase(expand(endOfLife.varName, buf));
+}
+
+void Interpreter::visitParallel(ast::Parallel & parallel) {
+    // the workers time the statements of the parallel block, not this one
+    statementsRun += 1;
+    // objects reachable from several groups get their counters updated concurrently
+    globals.publish(parallel.usedVars);
+
+    struct Failure {
+        std::pair<std::size_t, uint> where; // the statement and the iteration
+        std::exception_ptr error;
+    };
+    std::vector<std::optional<Failure>> failures(parallel.groups.size());
+    auto runGroup = [this, &parallel, &failures](std::size_t group) {
+        auto worker = Interpreter(parallel.body, *this);
+        for (auto & part : parallel.groups[group]) {
+            auto & stat = parallel.body[part.stat];
+            auto loop = dynamic_cast<ast::Repeat *>(stat.get());
+            uint iteration = part.begin;
+            try {
+                if (loop == nullptr) {
+                    worker.interpret(stat);
+                    continue;
+                }
+                for (; iteration < part.end; ++iteration) {
+                    worker.runIterations(*loop, iteration, iteration + 1);
+                }
+            } catch (...) {
+                failures[group] = Failure{{part.stat, iteration}, std::current_exception()};
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t group = 1; group < parallel.groups.size(); ++group) {
+        workers.emplace_back([&runGroup, group, heapStats = HeapStats::current, perf = PerfReport::current]() {
+            HeapStats::current = heapStats;
+            PerfReport::current = perf;
+            ThreadPerf threadPerf;
+            runGroup(group);
+        });
+    }
+    runGroup(0);
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    // the sequential run would stop at the earliest failure, and the groups are independent
+    std::optional<Failure> first;
+    for (auto & failure : failures) {
+        if (failure && (!first || failure->where < first->where)) {
+            first = failure;
+        }
+    }
+    if (first) {
+        std::rethrow_exception(first->error);
+    }
 }
 
 Interpreter::~Interpreter() {
+    // the interpretation could have been interrupted by an error
+    for (auto & thread : subThreads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
     log("=====================================================================");
+    if (times != nullptr) {
+        times->add(statementMicros);
+    }
     log("The interpreter is gone");
     log("=====================================================================");
 }
 
 AssignableResolver::AssignableResolver(Interpreter & interp, ast::AssignableTo & assignableTo)
         : interp(interp)
-        , containingObj()
+        , containing()
+        , containingObj(nullptr)
         , varName() {
     assignableTo.accept(*this);
 }
 
 Scope & AssignableResolver::scope() const {
-    if (containingObj.isEmpty()) {
+    if (containingObj == nullptr) {
         return interp.globals;
     } else {
         return containingObj->getFields();
@@ -165,40 +382,70 @@ std::string AssignableResolver::name() const {
 }
 
 void AssignableResolver::visitVar(ast::Var & astVar) {
-    assert(containingObj.isEmpty());
-    varName = astVar.name;
+    assert(containingObj == nullptr);
+    std::string buf;
+    varName = interp.expand(astVar.name, buf);
 }
 
 void AssignableResolver::visitSelectField(ast::SelectField & selectField) {
-    auto evaluator = Evaluator(interp, *selectField.obj);
-    containingObj = std::move(evaluator.eval());
-    varName = selectField.name;
+    containing.emplace(interp, *selectField.obj);
+    containingObj = containing->evalObject();
+    std::string buf;
+    varName = interp.expand(selectField.name, buf);
 }
 
 Evaluator::Evaluator(Interpreter & interp, ast::Expression & expr)
         : interp(interp)
-        , result() {
+        , anchor()
+        , result(nullptr) {
     expr.accept(*this);
 }
 
-RefToObj & Evaluator::eval() {
-    assert(!result.isEmpty());
-    return result;
+RefToObj const & Evaluator::eval() const {
+    assert(result != nullptr && !result->isEmpty());
+    return *result;
+}
+
+bool Evaluator::isOwned() const {
+    return result == &anchor;
+}
+
+Object * Evaluator::evalObject() {
+    if (eval().isWeak()) {
+        // nothing keeps the referent of a weak reference alive
+        anchor = std::move(RefToObj::makeStrong(eval()));
+        result = &anchor;
+    }
+    return eval().get();
+}
+
+RefToObj Evaluator::takeStrong() {
+    if (isOwned() && !anchor.isWeak()) {
+        result = nullptr;
+        return std::move(anchor);
+    }
+    return RefToObj::makeStrong(eval());
 }
 
 void Evaluator::visitNewObject(ast::NewObject & newObject) {
-    result = std::move(RefToObj::newStrong(new Object(newObject.name)));
+    anchor = std::move(RefToObj::newStrong(new Object(newObject.name, newObject.threadLocal)));
+    result = &anchor;
 }
 
 void Evaluator::visitVar(ast::Var & var) {
-    visitAssignableTo(var);
+    std::string buf;
+    auto & name = interp.expand(var.name, buf);
+    result = interp.globals.borrow(name);
+    if (result == nullptr) {
+        anchor = std::move(interp.globals.get(name));
+        result = &anchor;
+    }
 }
 
 void Evaluator::visitSelectField(ast::SelectField & selectField) {
-    visitAssignableTo(selectField);
-}
-
-void Evaluator::visitAssignableTo(ast::AssignableTo & assignableTo) {
-    auto resolver = AssignableResolver(interp, assignableTo);
-    result = std::move(resolver.scope().get(resolver.name()));
+    selectField.obj->accept(*this);
+    // the containing object is anchored either by `anchor` or by the scope the previous reference was borrowed from,
+    // and fields are never overwritten, so the borrowed field outlives the statement as well
+    std::string buf;
+    result = evalObject()->getFields().borrow(interp.expand(selectField.name, buf));
 }
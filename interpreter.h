@@ -3,57 +3,131 @@
 #include <vector>
 #include <thread>
 #include <functional>
+#include <mutex>
+#include <optional>
 
 #include "ast.h"
 #include "mm.h"
+#include "output.h"
+
+/**
+ * How long the statements of a single program take, in microseconds.
+ * Only the statements which don't run other statements are timed, e.g. not loops.
+ */
+class StatementTimes {
+public:
+    void add(std::vector<double> const & micros);
+    [[nodiscard]] std::size_t count();
+    /**
+     * @param q from 0 to 1.
+     */
+    [[nodiscard]] double quantile(double q);
+
+    /**
+     * The times of the program run by the current thread, if anyone is interested in them.
+     */
+    static thread_local StatementTimes * current;
+private:
+    std::mutex mutex;
+    std::vector<double> micros;
+};
 
 class Interpreter : public ast::Statement::Visitor {
 public:
-    Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, std::unordered_set<std::string> const & globalNames);
-    Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Globals && globals);
+    Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, std::unordered_set<std::string> const & globalNames, Output & output);
+    Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Globals && globals, Output & output);
+private:
+    /**
+     * A worker running a part of the parent's statements over the parent's variables.
+     */
+    Interpreter(std::vector<std::unique_ptr<ast::Statement>> const & prog, Interpreter & parent);
+public:
     ~Interpreter();
     void interpret();
     void interpret(std::unique_ptr<ast::Statement> const & stat);
+    /**
+     * Waits for the started threads and submits the output.
+     */
+    void finish();
+    /**
+     * Substitutes the counters of the running loops into a name.
+     * Returns either `name` itself or `buf`, containing the result.
+     */
+    std::string const & expand(std::string const & name, std::string & buf) const;
+private:
+    Globals ownGlobals;
 public:
     std::vector<std::unique_ptr<ast::Statement>> const & prog;
-    Globals globals;
+    Globals & globals; // either its own, or the parent's for a worker
     std::vector<std::thread> subThreads;
 private:
+    std::unordered_map<std::string, std::size_t> threadHandles; // indices in `subThreads`
+    Output::Buffer output;
+    ast::Repeat::Counters counters;
+    StatementTimes * times;
+    std::vector<double> statementMicros; // handed over to `times` at the end
+    std::size_t statementsRun = 0;
 
     void visitAssign(ast::Assign & assign) override;
     void visitNewThread(ast::NewThread & astNewThread) override;
+    void visitRepeat(ast::Repeat & repeat) override;
+    void visitJoin(ast::Join & join) override;
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override;
     void visitSleep(ast::Sleep & sleep) override;
     void visitSleepr(ast::Sleepr & sleepr) override;
     void visitDump(ast::Dump & dump) override;
+    void visitStats(ast::Stats & stats) override;
+    void visitFreeze(ast::Freeze & freeze) override;
 
     void visitEndOfLife(ast::EndOfLife & endOfLife) override;
+    void visitParallel(ast::Parallel & parallel) override;
+
+    void runIterations(ast::Repeat & repeat, uint begin, uint end);
 };
 
-class AssignableResolver : public ast::Expression::Visitor {
+class Evaluator : public ast::Expression::Visitor {
 public:
-    explicit AssignableResolver(Interpreter & interp, ast::AssignableTo & assignableTo);
-    [[nodiscard]] Scope & scope() const;
-    [[nodiscard]] std::string name() const;
+    explicit Evaluator(Interpreter & interp, ast::Expression & expr);
+    Evaluator(Evaluator const & that) = delete;
+    Evaluator & operator =(Evaluator const & that) = delete;
+    /**
+     * The resulting reference.
+     * It's borrowed from the scope it's stored in, when possible, so it stays valid only while the evaluator does.
+     */
+    [[nodiscard]] RefToObj const & eval() const;
+    /**
+     * Whether the result is a reference owned by the evaluator, and thus accounted in the referent's counter.
+     */
+    [[nodiscard]] bool isOwned() const;
+    /**
+     * The object the expression evaluates to, kept alive while the evaluator is.
+     */
+    Object * evalObject();
+    /**
+     * Upgrades the result to an owned strong reference.
+     */
+    RefToObj takeStrong();
 private:
     Interpreter & interp;
-    RefToObj containingObj; // if the scope is a field, anchors the containing object
-    std::string varName;
+    RefToObj anchor; // an owned reference, anchoring everything borrowed by `result`
+    RefToObj const * result;
 
-    void visitVar(ast::Var & astVar) override;
+    void visitNewObject(ast::NewObject & newObject) override;
+    void visitVar(ast::Var & var) override;
     void visitSelectField(ast::SelectField & selectField) override;
 };
 
-class Evaluator : public ast::Expression::Visitor {
+class AssignableResolver : public ast::Expression::Visitor {
 public:
-    explicit Evaluator(Interpreter & interp, ast::Expression & expr);
-    RefToObj & eval();
+    explicit AssignableResolver(Interpreter & interp, ast::AssignableTo & assignableTo);
+    [[nodiscard]] Scope & scope() const;
+    [[nodiscard]] std::string name() const;
 private:
     Interpreter & interp;
-    RefToObj result;
+    std::optional<Evaluator> containing; // if the scope is a field, anchors the containing object
+    Object * containingObj;
+    std::string varName;
 
-    void visitNewObject(ast::NewObject & newObject) override;
-    void visitVar(ast::Var & var) override;
+    void visitVar(ast::Var & astVar) override;
     void visitSelectField(ast::SelectField & selectField) override;
-
-    void visitAssignableTo(ast::AssignableTo & assignableTo);
 };
@@ -7,7 +7,7 @@ void log(std::string const & msg) {
 }
 
 void log(std::stringstream const & buf) {
-    // TODO move this check outside to prevent redundant string manipulations, if a compiler would fail to.
+    // hot paths check ENABLED themselves before building the message
     if (ENABLED) {
         std::stringstream finalBuf;
         finalBuf << "[Thread " << std::hex << std::this_thread::get_id() << std::dec << "] " << buf.str();
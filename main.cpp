@@ -1,29 +1,96 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <iostream>
 #include <vector>
-#include <fstream>
 #include <memory>
+#include <string>
+#include <thread>
 
 #include "run.h"
-
-std::string getFileContent(std::string const & path) {
-    std::ifstream file(path);
-    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    return content;
-}
+#include "batch.h"
+#include "server.h"
+#include "stream.h"
+#include "cache.h"
+#include "mm.h"
+#include "preparation.h"
 
 void printUsageAndDie() {
     std::cerr << "Usage: arc <script.arc>" << std::endl;
+    std::cerr << "       arc --restore <image> <script.arc>" << std::endl;
+    std::cerr << "       arc --stream <script.arc>" << std::endl;
+    std::cerr << "       arc --perf-counters <script.arc>" << std::endl;
+    std::cerr << "       arc --batch <dir> [-j <jobs>]" << std::endl;
+    std::cerr << "       arc --serve <socket>" << std::endl;
+    std::cerr << "       arc --submit <socket> <script.arc>" << std::endl;
+    std::cerr << "Counts of the memory manager operations and of the preparation steps are printed at exit if $ARC_STATS is set." << std::endl;
+    std::cerr << "Compiled scripts are cached in $ARC_CACHE_DIR (~/.cache/arc by default, set it empty to turn the cache off), up to 256 MB." << std::endl;
     exit(1);
 }
 
 int main(int argc, char ** argv) {
-    if (argc != 2) {
-        printUsageAndDie();
+    auto args = std::vector<std::string>(argv + 1, argv + argc);
+    if (std::getenv("ARC_STATS") != nullptr) {
+        // the shards of the threads are summed up after they finish, so the sum lives until the very end
+        OpStats::total();
+        PreparationStats::total();
+        std::atexit([]() {
+            std::cerr << "stats: ";
+            OpStats::print(OpStats::total(), std::cerr);
+            std::cerr << std::endl;
+            std::cerr << "preparation: ";
+            PreparationStats::total().print(std::cerr);
+            std::cerr << std::endl;
+        });
+    }
+    if (args.size() == 1 && args[0].rfind("--", 0) != 0) {
+        auto prog = getFileContent(args[0]);
+        runCached(prog, ScriptCache(ScriptCache::defaultDir()), std::cout);
+        return 0;
+    }
+
+    if (args.size() == 3 && args[0] == "--restore") {
+        auto prog = getFileContent(args[2]);
+        run(prog, std::cout, args[1]);
+        return 0;
+    }
+
+    if (args.size() == 2 && args[0] == "--perf-counters") {
+        runWithPerfCounters(getFileContent(args[1]), std::cout, std::cerr);
+        return 0;
     }
-    auto filename = argv[1];
-    auto prog = getFileContent(filename);
 
-    run(prog);
+    if (args.size() == 2 && args[0] == "--stream") {
+        runStreaming(args[1], std::cout);
+        return 0;
+    }
+
+    if (args.size() >= 2 && args[0] == "--batch") {
+        uint jobs = std::max(std::thread::hardware_concurrency(), 1u);
+        if (args.size() == 4 && args[2] == "-j") {
+            auto & digits = args[3];
+            // digits only, to fit into `uint`
+            bool isNumber = !digits.empty() && digits.length() <= 9
+                && std::all_of(digits.begin(), digits.end(), [](char c) { return std::isdigit((unsigned char) c); });
+            if (!isNumber || std::stoul(digits) == 0) {
+                printUsageAndDie();
+            }
+            jobs = std::stoul(digits);
+        } else if (args.size() != 2) {
+            printUsageAndDie();
+        }
+        return runBatch(args[1], jobs, std::cout) ? 0 : 1;
+    }
+
+    if (args.size() == 2 && args[0] == "--serve") {
+        Server server(args[1]);
+        server.serve(std::cerr);
+        return 0;
+    }
+
+    if (args.size() == 3 && args[0] == "--submit") {
+        return submit(args[1], getFileContent(args[2]), std::cout) ? 0 : 1;
+    }
 
-    return 0;
+    printUsageAndDie();
 }
@@ -1,46 +1,291 @@
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <sched.h>
 #include "mm.h"
 #include "logger.h"
 
+/**
+ * Counts of references, one per CPU, each on a cache line of its own.
+ */
+struct Collectible::Stripes {
+    struct alignas(64) Stripe {
+        std::atomic<uint> count = 0;
+    };
+
+    Stripes() : stripes(new Stripe[size()]) {}
+
+    /**
+     * The stripe of the CPU the caller runs on, or of the caller itself if that's unknown.
+     * Counts are interchangeable, so the caller may move to another CPU right away.
+     */
+    Stripe & own() {
+        auto cpu = sched_getcpu();
+        if (cpu < 0) {
+            static std::atomic<uint> nextThread = 0;
+            thread_local uint thread = nextThread++;
+            cpu = static_cast<int>(thread);
+        }
+        return stripes[static_cast<uint>(cpu) % size()];
+    }
+
+    static uint size() {
+        static uint const SIZE = std::clamp(std::thread::hardware_concurrency(), 1u, 64u);
+        return SIZE;
+    }
+
+    std::unique_ptr<Stripe[]> stripes;
+};
+
+/**
+ * How much a failed update of a counter adds to its contention, while an increment which succeeds at once takes one off.
+ * So a counter is striped after 64 failures in a row, or once there's more than one failure per four increments for long enough.
+ * Decrements don't take off, the instance may be gone right after one.
+ */
+static uint const FAILURE_WEIGHT = 4;
+static uint const INFLATE_AFTER = 64 * FAILURE_WEIGHT;
+
 Collectible::Collectible() : refCounter(1) {}
 
 void Collectible::incCounter() {
-    auto prev = refCounter.fetch_add(1, std::memory_order_acq_rel);
+    uint64_t prev;
+    if (shared.load(std::memory_order_relaxed)) {
+        prev = refCounter.load(std::memory_order_relaxed);
+        auto contended = false;
+        while (true) {
+            if ((prev & INFLATED) != 0 && incStriped()) {
+                break;
+            }
+            // counting directly is right even if the counter gets inflated meanwhile
+            if (refCounter.compare_exchange_weak(prev, prev + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                break;
+            }
+            onContention();
+            contended = true;
+        }
+        if (!contended) {
+            onUncontended();
+        }
+    } else {
+        prev = refCounter.load(std::memory_order_relaxed);
+        refCounter.store(prev + 1, std::memory_order_relaxed);
+    }
     // Counter should have been initialized in constructor.
     // And it should be impossible to try to incCounter for the object,
     // that can die in a process (i.e. our caller should hold a strong ref to the object).
     assert(prev != 0);
-    std::stringstream buf;
-    buf << "Inc counter in " << this << " (was " << prev << ")" << std::endl;
-    log(buf);
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "Inc counter in " << this << " (was " << (prev & DIRECT) << ")" << std::endl;
+        log(buf);
+    }
+}
+
+bool Collectible::tryIncCounter() {
+    uint64_t prev;
+    if (shared.load(std::memory_order_relaxed)) {
+        prev = refCounter.load(std::memory_order_relaxed);
+        auto contended = false;
+        while (true) {
+            // once the counter is zero the instance is dying, and nothing can take a reference anymore
+            if ((prev & (DIRECT | STRIPES)) == 0) {
+                return false;
+            }
+            if (refCounter.compare_exchange_weak(prev, prev + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                break;
+            }
+            onContention();
+            contended = true;
+        }
+        if (!contended) {
+            onUncontended();
+        }
+    } else {
+        prev = refCounter.load(std::memory_order_relaxed);
+        if (prev == 0) {
+            return false;
+        }
+        refCounter.store(prev + 1, std::memory_order_relaxed);
+    }
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "Inc counter in " << this << " (was " << (prev & DIRECT) << ")" << std::endl;
+        log(buf);
+    }
+    return true;
+}
+
+bool Collectible::incStriped() {
+    auto all = stripes.load(std::memory_order_acquire);
+    if (all == nullptr) {
+        return false;
+    }
+    auto & stripe = all->own().count;
+    auto count = stripe.load(std::memory_order_relaxed);
+    while (count > 0) {
+        if (stripe.compare_exchange_weak(count, count + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    // an empty stripe gets a reference of the counter first, so the counter can't drop to zero while the stripe counts
+    auto counter = refCounter.load(std::memory_order_relaxed);
+    do {
+        if ((counter & INFLATED) == 0) {
+            return false;
+        }
+    } while (!refCounter.compare_exchange_weak(counter, counter + STRIPE, std::memory_order_acq_rel, std::memory_order_relaxed));
+    if (stripe.fetch_add(1, std::memory_order_acq_rel) > 0) {
+        // another thread has filled the stripe meanwhile, and it holds a reference of its own
+        refCounter.fetch_sub(STRIPE, std::memory_order_acq_rel);
+    }
+    return true;
 }
 
 void Collectible::decCounter() {
-    auto prev = refCounter.fetch_sub(1, std::memory_order_acq_rel);
-    {
+    uint64_t prev;
+    if (shared.load(std::memory_order_relaxed)) {
+        prev = refCounter.load(std::memory_order_relaxed);
+        while (true) {
+            auto all = stripes.load(std::memory_order_acquire);
+            if ((prev & INFLATED) != 0 && all != nullptr) {
+                // the stripes are emptied first, to deflate the counter as soon as the contention is over
+                auto own = static_cast<std::size_t>(&all->own() - all->stripes.get());
+                for (std::size_t k = 0; k < Stripes::size(); ++k) {
+                    if (decStriped((own + k) % Stripes::size())) {
+                        return;
+                    }
+                }
+                if ((prev & DIRECT) == 0) {
+                    // a stripe has been emptied and filled again meanwhile
+                    prev = refCounter.load(std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            assert((prev & DIRECT) != 0);
+            if (refCounter.compare_exchange_weak(prev, deflated(prev - 1), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                break;
+            }
+            onContention();
+        }
+    } else {
+        prev = refCounter.load(std::memory_order_relaxed);
+        refCounter.store(prev - 1, std::memory_order_relaxed);
+    }
+    if (ENABLED) {
         std::stringstream buf;
-        buf << "Dec counter in " << this << " (was " << prev << ")" << std::endl;
+        buf << "Dec counter in " << this << " (was " << (prev & DIRECT) << ")" << std::endl;
         log(buf);
     }
-    if (prev == 1) {
+    settle(prev - 1);
+}
+
+bool Collectible::decStriped(std::size_t stripe) {
+    auto & count = stripes.load(std::memory_order_acquire)->stripes[stripe].count;
+    auto prev = count.load(std::memory_order_relaxed);
+    while (prev > 0) {
+        if (count.compare_exchange_weak(prev, prev - 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            if (prev == 1) {
+                auto counter = refCounter.load(std::memory_order_relaxed);
+                while (!refCounter.compare_exchange_weak(counter, deflated(counter - STRIPE), std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+                settle(counter - STRIPE);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void Collectible::settle(uint64_t counter) {
+    if ((counter & (DIRECT | STRIPES)) == 0) {
         // free the object only if we were the thread that have seen the pre-zero counter
-        {
+        if (ENABLED) {
             std::stringstream buf;
             buf << "Object " << this << " got dead" << std::endl;
             log(buf);
         }
-        delete this;
+        dispose();
+    }
+}
+
+uint64_t Collectible::deflated(uint64_t counter) {
+    if ((counter & (INFLATED | STRIPES)) != INFLATED) {
+        return counter;
+    }
+    // the update may still fail, and the counter get striped again, which only makes it inflate later
+    contention.store(0, std::memory_order_relaxed);
+    return counter & DIRECT;
+}
+
+void Collectible::onContention() {
+    if (Stripes::size() == 1) {
+        return;
     }
+    auto prev = contention.fetch_add(FAILURE_WEIGHT, std::memory_order_relaxed);
+    if (prev < INFLATE_AFTER && prev + FAILURE_WEIGHT >= INFLATE_AFTER) {
+        inflate();
+    }
+}
+
+void Collectible::onUncontended() {
+    // a plain load on the fast path, the line is already owned after the update of the counter
+    auto prev = contention.load(std::memory_order_relaxed);
+    if (prev > 0) {
+        // losing the decay to a concurrent update is fine, the count is only a hint
+        contention.compare_exchange_weak(prev, prev - 1, std::memory_order_relaxed, std::memory_order_relaxed);
+    }
+}
+
+void Collectible::inflate() {
+    assert(isShared());
+    auto all = stripes.load(std::memory_order_acquire);
+    if (all == nullptr) {
+        auto made = new Stripes();
+        if (stripes.compare_exchange_strong(all, made, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            all = made;
+        } else {
+            delete made;
+        }
+    }
+    auto counter = refCounter.load(std::memory_order_relaxed);
+    while ((counter & INFLATED) == 0
+           && !refCounter.compare_exchange_weak(counter, counter | INFLATED, std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+}
+
+bool Collectible::isInflated() const {
+    return (refCounter.load(std::memory_order_relaxed) & INFLATED) != 0;
+}
+
+void Collectible::dispose() {
+    delete this;
 }
 
 Collectible::~Collectible() {
     refCounter.store(0xBADBAD, std::memory_order_relaxed);
+    delete stripes.load(std::memory_order_relaxed);
 }
 
 uint Collectible::getRefCounter() const {
-    return refCounter.load(std::memory_order_relaxed); // not to synchronize with
+    auto counter = refCounter.load(std::memory_order_relaxed); // not to synchronize with
+    auto count = static_cast<uint>(counter & DIRECT);
+    auto all = stripes.load(std::memory_order_acquire);
+    if ((counter & INFLATED) != 0 && all != nullptr) {
+        for (std::size_t stripe = 0; stripe < Stripes::size(); ++stripe) {
+            count += all->stripes[stripe].count.load(std::memory_order_relaxed);
+        }
+    }
+    return count;
+}
+
+bool Collectible::hasSingleOwner() const {
+    return refCounter.load(std::memory_order_acquire) == 1;
+}
+
+bool Collectible::isShared() const {
+    return shared.load(std::memory_order_relaxed);
 }
 
 RefToObj::RefToObj() : RefToObj(0) {}
@@ -56,6 +301,7 @@ RefToObj::RefToObj(RefToObj const & that) noexcept : RefToObj() {
     auto thatReferent = that.referent.load(std::memory_order_relaxed);
     auto thatPtr = clearWeakFlag(thatReferent);
     thatPtr->incCounter();
+    OpStats::count((thatReferent & WEAK_TAG) != 0 ? OpStats::WeakInc : OpStats::StrongInc);
     referent.exchange(thatReferent, std::memory_order_relaxed);
 }
 
@@ -65,8 +311,10 @@ RefToObj::~RefToObj() {
     if (taggedReferentPtr != 0) {
         if ((taggedReferentPtr & WEAK_TAG) != 0) {
             collectible = (WeakRef *) clearWeakFlag(taggedReferentPtr);
+            OpStats::count(OpStats::WeakDec);
         } else {
             collectible = (Object *) taggedReferentPtr;
+            OpStats::count(OpStats::StrongDec);
         }
         collectible->decCounter();
     }
@@ -131,18 +379,34 @@ Collectible * RefToObj::clearWeakFlag(std::size_t tagged) {
 }
 
 RefToObj RefToObj::newStrong(Object * obj) {
-    std::stringstream buf;
-    buf << "New strong ref to " << obj << std::endl;
-    log(buf);
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "New strong ref to " << obj << std::endl;
+        log(buf);
+    }
     assert(obj->getRefCounter() == 1);
     auto taggedReferentPtr = (std::size_t) obj;
     return RefToObj(taggedReferentPtr);
 }
 
+RefToObj RefToObj::newWeak(WeakRef * weakRef) {
+    assert(weakRef->getRefCounter() == 1);
+    auto taggedReferentPtr = (std::size_t) weakRef | WEAK_TAG;
+    return RefToObj(taggedReferentPtr);
+}
+
 RefToObj RefToObj::makeStrong(RefToObj const & orig) {
+    if (orig.isWeak()) {
+        auto strong = upgrade(orig);
+        if (strong.isEmpty()) {
+            throw WeakRef::InvalidAccess();
+        }
+        return strong;
+    }
     auto obj = orig.get();
     obj->incCounter();
-    {
+    OpStats::count(OpStats::StrongInc);
+    if (ENABLED) {
         std::stringstream buf;
         buf << "New strong ref to " << obj << std::endl;
         log(buf);
@@ -151,34 +415,74 @@ RefToObj RefToObj::makeStrong(RefToObj const & orig) {
     return RefToObj(taggedReferentPtr);
 }
 
+RefToObj RefToObj::upgrade(RefToObj const & orig) {
+    auto taggedReferentPtr = orig.referent.load(std::memory_order_acquire);
+    if ((taggedReferentPtr & WEAK_TAG) == 0) {
+        return makeStrong(orig);
+    }
+    // the proxy is held by `orig`, and it keeps the memory of its referent, so the counter can be looked at
+    auto weakRef = (WeakRef *) clearWeakFlag(taggedReferentPtr);
+    auto obj = weakRef->referent.load(std::memory_order_acquire);
+    if (obj == nullptr || !obj->tryIncCounter()) {
+        return {};
+    }
+    OpStats::count(OpStats::StrongInc);
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "New strong ref to " << obj << std::endl;
+        log(buf);
+    }
+    return RefToObj((std::size_t) obj);
+}
+
 RefToObj RefToObj::makeWeak(RefToObj const & orig) {
+    if (orig.isWeak()) {
+        // the weak reference shares the proxy of the original one
+        auto taggedReferentPtr = orig.referent.load(std::memory_order_acquire);
+        auto weakRef = (WeakRef *) clearWeakFlag(taggedReferentPtr);
+        if (weakRef->referent.load(std::memory_order_acquire) == nullptr) {
+            throw WeakRef::InvalidAccess();
+        }
+        weakRef->incCounter();
+        OpStats::count(OpStats::WeakInc);
+        return RefToObj(taggedReferentPtr);
+    }
     auto obj = orig.get();
-    {
+    if (ENABLED) {
         std::stringstream buf;
         buf << "New weak ref to " << obj << std::endl;
         log(buf);
     }
     WeakRef * weakRef;
-    if (obj->weakRef.isEmpty(std::memory_order_relaxed)) {
-        weakRef = new WeakRef();
-        {
-            std::stringstream buf;
-            buf << "Weak ref " << weakRef << " allocated" << std::endl;
-            log(buf);
+    if (obj->weakRef.isEmpty(std::memory_order_acquire)) {
+        auto made = new WeakRef(obj);
+        WeakRef * none = nullptr;
+        // other threads may be making a weak reference to the same object
+        if (obj->weakRef.referent.compare_exchange_strong(none, made, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            OpStats::count(OpStats::WeakProxy);
+            if (ENABLED) {
+                std::stringstream buf;
+                buf << "Weak ref " << made << " allocated" << std::endl;
+                log(buf);
+            }
+        } else {
+            made->clear();
+            delete made;
         }
-        weakRef->referent.store(obj, std::memory_order_relaxed);
-        obj->weakRef.referent.store(weakRef, std::memory_order_release);
     }
     weakRef = obj->weakRef.asPtr();
     weakRef->incCounter();
+    OpStats::count(OpStats::WeakInc);
     auto taggedReferentPtr = (std::size_t) weakRef | WEAK_TAG;
     return RefToObj(taggedReferentPtr);
 }
 
 Global::~Global() {
-    std::stringstream buf;
-    buf << "Global " << this << " got dead" << std::endl;
-    log(buf);
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "Global " << this << " got dead" << std::endl;
+        log(buf);
+    }
 }
 
 WeakRef::WeakRef() : referent(nullptr) {}
@@ -187,6 +491,7 @@ WeakRef::WeakRef(Object * referent) : referent(referent) {}
 
 WeakRef::~WeakRef() {
     assert(referent.load(std::memory_order_relaxed) == nullptr);
+    delete remains;
 }
 
 void WeakRef::clear() {
@@ -213,7 +518,14 @@ Globals::Globals(std::unordered_set<std::string> const & names) : globals() {
     }
 }
 
+void Globals::declare(std::unordered_set<std::string> const & names) {
+    for (auto & name : names) {
+        globals[name];
+    }
+}
+
 RefToObj Globals::get(std::string const & name) const {
+    OpStats::count(OpStats::GlobalGet);
     auto & refToGlobal = globals.at(name);
     if (refToGlobal.isEmpty(std::memory_order_acquire)) {
         throw NoSuchVar("global variable", name);
@@ -221,9 +533,28 @@ RefToObj Globals::get(std::string const & name) const {
     return refToGlobal->ref;
 }
 
+RefToObj const * Globals::borrow(std::string const & name) const {
+    OpStats::count(OpStats::GlobalGet);
+    auto & refToGlobal = globals.at(name);
+    if (refToGlobal.isEmpty(std::memory_order_acquire)) {
+        throw NoSuchVar("global variable", name);
+    }
+    // Globals are shared only by the interpreter owning them, when it starts a new thread.
+    // So if nobody else holds the global now, nobody can overwrite it until the statement is over.
+    if (!refToGlobal->hasSingleOwner()) {
+        return nullptr;
+    }
+    return &refToGlobal->ref;
+}
+
 void Globals::put(std::string const & name, RefToObj && value) {
+    OpStats::count(OpStats::GlobalPut);
     auto & refToGlobal = globals.at(name);
     refToGlobal.initIfEmpty(); // first assignment is initialization
+    if (!refToGlobal->hasSingleOwner()) {
+        // the global is shared with a running thread
+        Object::publish(value);
+    }
     refToGlobal->ref = std::move(value);
 }
 
@@ -238,13 +569,48 @@ Globals Globals::makeSubsetInitIfNeeded(std::unordered_set<std::string> const &
         x.initIfEmpty();
         auto ptr = x.asPtr();
         assert(ptr != nullptr);
+        if (!ptr->ref.isEmpty()) {
+            Object::publish(ptr->ref);
+        }
         subset.globals.at(var) = std::move(StrongRef<Global>::makeStrong(ptr));
     }
     return std::move(subset);
 }
 
+void Globals::publish(std::unordered_set<std::string> const & names) const {
+    for (auto & name : names) {
+        auto & refToGlobal = globals.at(name);
+        if (!refToGlobal.isEmpty(std::memory_order_acquire) && !refToGlobal->ref.isEmpty()) {
+            Object::publish(refToGlobal->ref);
+        }
+    }
+}
+
+std::unordered_map<std::string, RefToObj> Globals::getMap() const {
+    std::unordered_map<std::string, RefToObj> result;
+    for (auto & [name, refToGlobal] : globals) {
+        // a global can be created for a thread before its first assignment
+        if (!refToGlobal.isEmpty(std::memory_order_acquire) && !refToGlobal->ref.isEmpty()) {
+            result.emplace(name, refToGlobal->ref);
+        }
+    }
+    return result;
+}
+
+Fields::Fields(Object const & owner) : owner(owner) {}
+
+std::unique_lock<std::mutex> Fields::lock() const {
+    // the stores to a frozen table happen before it's frozen, which the acquire synchronizes with
+    if (owner.isShared() && !frozen.load(std::memory_order_acquire)) {
+        OpStats::count(OpStats::FieldsLock);
+        return std::unique_lock<std::mutex>(mutex);
+    }
+    return {};
+}
+
 RefToObj Fields::get(std::string const & name) const {
-    auto lock = std::lock_guard<std::mutex>(mutex);
+    OpStats::count(OpStats::FieldGet);
+    auto lock = this->lock();
 
     try {
         return fields.at(name);
@@ -253,31 +619,200 @@ RefToObj Fields::get(std::string const & name) const {
     }
 }
 
+RefToObj const * Fields::borrow(std::string const & name) const {
+    OpStats::count(OpStats::FieldGet);
+    auto lock = this->lock();
+
+    auto iter = fields.find(name);
+    if (iter == fields.end()) {
+        throw NoSuchVar("field", name);
+    }
+    // Fields are never overwritten and nodes of the map are never moved,
+    // so the reference lives as long as the object does.
+    return &iter->second;
+}
+
 void Fields::put(std::string const & name, RefToObj && value) {
-    auto lock = std::lock_guard<std::mutex>(mutex);
+    OpStats::count(OpStats::FieldPut);
+    if (owner.isShared()) {
+        Object::publish(value);
+    }
+    auto lock = this->lock();
+    // checked under the lock, so that the table can't get frozen meanwhile
+    if (frozen.load(std::memory_order_relaxed)) {
+        throw FrozenWrite(owner.getName(), name);
+    }
     fields.emplace(name, std::move(value));
 }
 
+void Fields::freeze() {
+    auto lock = this->lock();
+    frozen.store(true, std::memory_order_release);
+}
+
+bool Fields::isFrozen() const {
+    return frozen.load(std::memory_order_acquire);
+}
+
 std::unordered_map<std::string, Field> Fields::getMap() const {
+    auto lock = this->lock();
     return {fields};
 }
 
-Object::Object(std::string const & name) : name(name), weakRef() {
+Fields::FrozenWrite::FrozenWrite(std::string const & objName, std::string const & fieldName) {
     std::stringstream buf;
-    buf << "New object " << name << "(" << this << ")" << std::endl;
-    log(buf);
+    buf << "writing of field \"" << fieldName << "\" of frozen object " << objName;
+    descr = buf.str();
 }
 
-Object::~Object() {
-    std::stringstream buf;
-    buf << "Object " << name << "(" << this << ")" << " collected" << std::endl;
-    log(buf);
+char const * Fields::FrozenWrite::what() const noexcept {
+    return descr.c_str();
+}
+
+thread_local HeapStats * HeapStats::current = nullptr;
 
-    if (!weakRef.isEmpty(std::memory_order_relaxed)) {
-        weakRef->clear();
+void HeapStats::onAlloc() {
+    auto nowLive = live.fetch_add(1, std::memory_order_relaxed) + 1;
+    auto prevPeak = peak.load(std::memory_order_relaxed);
+    while (prevPeak < nowLive && !peak.compare_exchange_weak(prevPeak, nowLive, std::memory_order_relaxed)) {}
+}
+
+void HeapStats::onFree() {
+    live.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::size_t HeapStats::getLive() const {
+    return live.load(std::memory_order_relaxed);
+}
+
+std::size_t HeapStats::getPeak() const {
+    return peak.load(std::memory_order_relaxed);
+}
+
+std::array<char const *, OpStats::OP_COUNT> const OpStats::NAMES = {
+    "strong_incs", "strong_decs", "weak_incs", "weak_decs", "objects_freed", "weak_proxies",
+    "field_puts", "field_gets", "global_puts", "global_gets", "fields_locks",
+};
+
+/**
+ * The shards of the running threads, and what the finished ones counted.
+ */
+struct OpStats::Registry {
+    std::mutex mutex;
+    std::vector<Shard *> live;
+    Counts finished{};
+
+    static Registry & get() {
+        static Registry registry;
+        return registry;
+    }
+};
+
+thread_local OpStats::Shard OpStats::shard;
+
+OpStats::Shard::Shard() {
+    auto & registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.live.push_back(this);
+}
+
+OpStats::Shard::~Shard() {
+    auto & registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (std::size_t op = 0; op < OP_COUNT; ++op) {
+        registry.finished[op] += counts[op].load(std::memory_order_relaxed);
+    }
+    registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+}
+
+OpStats::Counts OpStats::total() {
+    auto & registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto total = registry.finished;
+    for (auto liveShard : registry.live) {
+        for (std::size_t op = 0; op < OP_COUNT; ++op) {
+            total[op] += liveShard->counts[op].load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+void OpStats::print(Counts const & counts, std::ostream & out) {
+    for (std::size_t op = 0; op < OP_COUNT; ++op) {
+        out << (op == 0 ? "" : ", ") << NAMES[op] << " = " << counts[op];
+    }
+}
+
+Object::Object(std::string const & name, bool threadLocal) : name(name), fields(*this), weakRef() {
+    shared.store(!threadLocal, std::memory_order_relaxed);
+    if (HeapStats::current != nullptr) {
+        HeapStats::current->onAlloc();
+    }
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "New object " << name << "(" << this << ")" << std::endl;
+        log(buf);
     }
 }
 
+Object::~Object() = default;
+
+void Object::dispose() {
+    if (ENABLED) {
+        std::stringstream buf;
+        buf << "Object " << name << "(" << this << ")" << " collected" << std::endl;
+        log(buf);
+    }
+    if (HeapStats::current != nullptr) {
+        HeapStats::current->onFree();
+    }
+    OpStats::count(OpStats::ObjectFree);
+
+    auto proxy = weakRef.asPtr();
+    if (proxy == nullptr) {
+        delete this;
+        return;
+    }
+    proxy->clear();
+    fields.fields.clear();
+    // the last reference to the proxy frees the object, possibly right here
+    proxy->remains = this;
+    weakRef = StrongRef<WeakRef>();
+}
+
 Fields & Object::getFields() {
     return fields;
 }
+
+std::string const & Object::getName() const {
+    return name;
+}
+
+void Object::publish(RefToObj const & ref) {
+    std::vector<Object *> pending;
+    auto push = [&pending](RefToObj const & ref) {
+        if (ref.isEmpty()) {
+            return;
+        }
+        try {
+            auto obj = ref.get();
+            if (!obj->isShared()) {
+                pending.push_back(obj);
+            }
+        } catch (WeakRef::InvalidAccess & ex) {}
+    };
+
+    push(ref);
+    while (!pending.empty()) {
+        auto obj = pending.back();
+        pending.pop_back();
+        if (obj->isShared()) {
+            continue;
+        }
+        obj->shared.store(true, std::memory_order_release);
+        // the object is still local, so its fields can be read without locking
+        for (auto & [name, field] : obj->fields.fields) {
+            push(field);
+        }
+    }
+}
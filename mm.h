@@ -1,9 +1,13 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <cstdint>
+#include <ostream>
 #include <variant>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 #include "ast.h"
 #include "logger.h"
 
@@ -14,11 +18,78 @@ class Collectible {
 public:
     Collectible();
     void incCounter();
+    /**
+     * Takes a reference for a caller which holds none, unless the counter has already dropped to zero.
+     * The memory of the instance must stay valid meanwhile, even if it's dying.
+     * @return whether the reference is taken.
+     */
+    [[nodiscard]] bool tryIncCounter();
     void decCounter();
     virtual ~Collectible();
     [[nodiscard]] uint getRefCounter() const;
+    /**
+     * Whether the caller's reference is the only one.
+     * Synchronizes with releases of all the other references.
+     * Never true while the counter is striped.
+     */
+    [[nodiscard]] bool hasSingleOwner() const;
+    /**
+     * Whether other threads may reach the instance.
+     * Counters of thread-local instances are updated without atomic read-modify-writes.
+     */
+    [[nodiscard]] bool isShared() const;
+    /**
+     * Stripes the counter of a shared instance, as if threads were contending for it.
+     * Happens by itself after enough failed updates, if there's more than one CPU.
+     */
+    void inflate();
+    [[nodiscard]] bool isInflated() const;
+protected:
+    /**
+     * The references counted directly, in the low 32 bits.
+     * A counter updated by several threads at once gets inflated: each thread counts on a stripe of its CPU,
+     * and a stripe which counts any references holds a single reference of the counter itself, one `STRIPE`.
+     * So the counter still drops to zero exactly when the last reference goes,
+     * and it deflates back as soon as the stripes get empty.
+     */
+    std::atomic<uint64_t> refCounter = 0;
+    std::atomic<bool> shared = true;
 private:
-    std::atomic<uint> refCounter = 0;
+    /**
+     * Failed updates of a shared counter, decaying with the increments which succeed at once.
+     * Declared here to fill the padding after `shared`.
+     */
+    std::atomic<uint> contention = 0;
+protected:
+
+    /**
+     * Called once the last reference is gone.
+     */
+    virtual void dispose();
+private:
+    struct Stripes;
+
+    static uint64_t const DIRECT = 0xFFFFFFFF;
+    static uint64_t const STRIPE = 1ull << 32;
+    static uint64_t const STRIPES = 0x3FFFFFFFull << 32;
+    static uint64_t const INFLATED = 1ull << 63;
+
+    std::atomic<Stripes *> stripes = nullptr; // kept once allocated, threads may still look at them after deflating
+
+    bool incStriped();
+    bool decStriped(std::size_t stripe);
+    void onContention();
+    void onUncontended();
+    /**
+     * The counter to store instead of `counter`, deflated if its stripes are empty.
+     * Deflating along with the update which empties the stripes, the caller still holds its reference,
+     * so the instance can't be freed meanwhile.
+     */
+    uint64_t deflated(uint64_t counter);
+    /**
+     * Frees the instance if `counter`, just stored, has no references left.
+     */
+    void settle(uint64_t counter);
 };
 
 template<typename T>
@@ -73,12 +144,27 @@ public:
     RefToObj & operator =(RefToObj const & that) noexcept;
     [[nodiscard]] bool isEmpty() const;
     [[nodiscard]] bool isWeak() const;
+    /**
+     * The referent of a weak reference may die any moment, unless the caller holds a strong reference to it.
+     */
     [[nodiscard]] Object * get() const;
     [[nodiscard]] Collectible * getRaw() const;
     Object & operator *() const;
     Object * operator ->() const;
     static RefToObj newStrong(Object * obj);
+    /**
+     * Takes over the only reference to a just created proxy.
+     */
+    static RefToObj newWeak(WeakRef * weakRef);
+    /**
+     * @throws WeakRef::InvalidAccess if the referent of a weak reference is collected.
+     */
     static RefToObj makeStrong(RefToObj const & orig);
+    /**
+     * A strong reference to the referent of `orig`, or an empty one if the referent of a weak reference is collected.
+     * Lock-free: races with the death of the referent are settled by its counter.
+     */
+    static RefToObj upgrade(RefToObj const & orig);
     static RefToObj makeWeak(RefToObj const & orig);
 private:
     static Collectible * clearWeakFlag(std::size_t tagged);
@@ -102,6 +188,7 @@ using Field = RefToObj;
  */
 class WeakRef : public Collectible {
     friend RefToObj;
+    friend Object;
 public:
     WeakRef();
     explicit WeakRef(Object * referent);
@@ -114,11 +201,18 @@ public:
     };
 private:
     std::atomic<Object *> referent;
+    Object * remains = nullptr; // the memory of the dead referent, upgrades may still be looking at its counter
 };
 
 class Scope {
 public:
     [[nodiscard]] virtual RefToObj get(std::string const & name) const = 0;
+    /**
+     * Returns the stored reference itself, without taking a new one.
+     * `nullptr` means that the scope can not guarantee the reference to stay intact until the end of the current statement,
+     * so `get` should be used instead.
+     */
+    [[nodiscard]] virtual RefToObj const * borrow(std::string const & name) const = 0;
     virtual void put(std::string const & name, RefToObj && value) = 0;
 
     class NoSuchVar : public std::exception {
@@ -133,34 +227,157 @@ public:
 class Globals : public Scope {
 public:
     explicit Globals(std::unordered_set<std::string> const & names);
+    /**
+     * Adds the names the program can define, once more of it is known.
+     * Must not be called while other threads use the instance.
+     */
+    void declare(std::unordered_set<std::string> const & names);
     [[nodiscard]] RefToObj get(std::string const & name) const override;
+    [[nodiscard]] RefToObj const * borrow(std::string const & name) const override;
     void put(std::string const & name, RefToObj && value) override;
     void erase(std::string const & name);
     Globals makeSubsetInitIfNeeded(std::unordered_set<std::string> const & names);
+    /**
+     * Makes the objects the variables reference shared, before other threads start using the variables.
+     */
+    void publish(std::unordered_set<std::string> const & names) const;
+
+    /**
+     * The defined variables.
+     */
+    std::unordered_map<std::string, RefToObj> getMap() const;
 private:
     std::unordered_map<std::string, StrongRef<Global>> globals;
 };
 
+/**
+ * Fields of a thread-local object, and of a frozen one, are accessed without locking.
+ */
 class Fields : public Scope {
+    friend Object;
 public:
-    Fields() = default;
+    explicit Fields(Object const & owner);
     RefToObj get(std::string const & name) const override;
+    RefToObj const * borrow(std::string const & name) const override;
+    /**
+     * @throws FrozenWrite if the fields are frozen.
+     */
     void put(std::string const & name, RefToObj && value) override;
+    /**
+     * Makes the set of fields immutable for good, so that readers don't have to lock it anymore.
+     */
+    void freeze();
+    [[nodiscard]] bool isFrozen() const;
 
     std::unordered_map<std::string, Field> getMap() const;
+
+    class FrozenWrite : public std::exception {
+    public:
+        FrozenWrite(std::string const & objName, std::string const & fieldName);
+        [[nodiscard]] char const * what() const noexcept override;
+    private:
+        std::string descr;
+    };
 private:
+    [[nodiscard]] std::unique_lock<std::mutex> lock() const;
+
+    Object const & owner;
     // a lock-free hash table would be a better choice, but it's to complex to spend time on
     mutable std::mutex mutex;
     std::unordered_map<std::string, Field> fields;
+    // set under the mutex, after which the table is read-only
+    std::atomic<bool> frozen = false;
+};
+
+/**
+ * Accounts the objects of a single program.
+ */
+class HeapStats {
+public:
+    void onAlloc();
+    void onFree();
+    [[nodiscard]] std::size_t getLive() const;
+    [[nodiscard]] std::size_t getPeak() const;
+
+    /**
+     * The stats of the program run by the current thread, if anyone is interested in them.
+     * Interpreter threads inherit it from the thread which starts them.
+     */
+    static thread_local HeapStats * current;
+private:
+    std::atomic<std::size_t> live = 0;
+    std::atomic<std::size_t> peak = 0;
+};
+
+/**
+ * Counts of the memory manager operations, for the whole process.
+ * Each thread counts into a shard of its own with plain loads and stores, cheap enough to be always on,
+ * and reading sums the shards up.
+ */
+class OpStats {
+public:
+    enum Op {
+        StrongInc,
+        StrongDec,
+        WeakInc,
+        WeakDec,
+        ObjectFree,
+        WeakProxy,
+        FieldPut,
+        FieldGet,
+        GlobalPut,
+        GlobalGet,
+        FieldsLock,
+        OP_COUNT,
+    };
+    using Counts = std::array<uint64_t, OP_COUNT>;
+
+    static void count(Op op) {
+        auto & counter = shard.counts[op];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    /**
+     * The counts of all the threads, including the finished ones.
+     * The running ones may count more meanwhile.
+     */
+    static Counts total();
+    static void print(Counts const & counts, std::ostream & out);
+
+    static std::array<char const *, OP_COUNT> const NAMES;
+private:
+    struct Shard {
+        Shard();
+        ~Shard();
+
+        std::array<std::atomic<uint64_t>, OP_COUNT> counts{};
+    };
+    struct Registry;
+
+    static thread_local Shard shard;
 };
 
 class Object : public Collectible {
     friend RefToObj;
 public:
-    explicit Object(std::string const & name);
+    /**
+     * @param threadLocal whether the object starts visible to the current thread only.
+     */
+    Object(std::string const & name, bool threadLocal);
     ~Object() override;
 
     Fields & getFields();
+    [[nodiscard]] std::string const & getName() const;
+    /**
+     * Makes the referenced object, and everything it reaches, shared before it gets visible to another thread.
+     * Shared objects reference only shared ones, so the traversal stops at them.
+     */
+    static void publish(RefToObj const & ref);
+protected:
+    /**
+     * Releases the fields and clears the weak reference proxy right away,
+     * but leaves the memory to the proxy, if there's one, to free.
+     */
+    void dispose() override;
 private:
     std::string name;
     Fields fields;
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cassert>
+#include "output.h"
+
+Output::Output(std::ostream & sink)
+        : sink(sink)
+        , nextSeq(0) {}
+
+Output::~Output() {
+    flush();
+    assert(buffers.empty());
+}
+
+void Output::flush() {
+    auto lock = std::lock_guard<std::mutex>(mutex);
+    writeOut(watermark());
+}
+
+void Output::submit(Buffer & buffer) {
+    auto lock = std::lock_guard<std::mutex>(mutex);
+    for (auto & piece : buffer.pieces) {
+        submitted.push_back(std::move(piece));
+    }
+    buffer.oldestPending.store(NONE_PENDING);
+    writeOut(watermark());
+}
+
+uint64_t Output::watermark() const {
+    // `nextSeq` must be read before the buffers' bounds:
+    // a buffer publishes its bound before taking a sequence number,
+    // so a piece stamped after this read can not be older than the result.
+    uint64_t result = nextSeq.load();
+    for (auto buffer : buffers) {
+        result = std::min(result, buffer->oldestPending.load());
+    }
+    return result;
+}
+
+void Output::writeOut(uint64_t upTo) {
+    std::sort(submitted.begin(), submitted.end(), [](Buffer::Piece const & a, Buffer::Piece const & b) {
+        return a.seq < b.seq;
+    });
+    auto end = std::find_if(submitted.begin(), submitted.end(), [upTo](Buffer::Piece const & piece) {
+        return piece.seq >= upTo;
+    });
+    if (end == submitted.begin()) {
+        return;
+    }
+    std::string chunk;
+    for (auto iter = submitted.begin(); iter != end; iter++) {
+        chunk += iter->text;
+    }
+    submitted.erase(submitted.begin(), end);
+    sink.write(chunk.data(), (std::streamsize) chunk.size());
+    sink.flush();
+}
+
+Output::Buffer::Buffer(Output & output)
+        : output(output)
+        , pieces()
+        , size(0)
+        , oldestPending(NONE_PENDING) {
+    auto lock = std::lock_guard<std::mutex>(output.mutex);
+    output.buffers.insert(this);
+}
+
+Output::Buffer::~Buffer() {
+    submit();
+    auto lock = std::lock_guard<std::mutex>(output.mutex);
+    output.buffers.erase(this);
+}
+
+void Output::Buffer::write(std::string && text) {
+    if (pieces.empty()) {
+        oldestPending.store(output.nextSeq.load());
+    }
+    auto seq = output.nextSeq.fetch_add(1);
+    size += text.size();
+    pieces.push_back({seq, std::move(text)});
+    if (size >= SUBMIT_THRESHOLD) {
+        submit();
+    }
+}
+
+void Output::Buffer::submit() {
+    if (pieces.empty()) {
+        return;
+    }
+    output.submit(*this);
+    pieces.clear();
+    size = 0;
+}
+
+Output & Output::Buffer::getOutput() const {
+    return output;
+}
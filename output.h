@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * The program output (i.e. the results of `dump`).
+ * Each interpreter thread writes into its own `Output::Buffer` without any synchronization.
+ * Filled buffers are submitted to the output, which writes them to the sink in large chunks.
+ * Every piece of the output is stamped with a global sequence number,
+ * so the sink gets the pieces in the very same order they were produced in.
+ */
+class Output {
+public:
+    explicit Output(std::ostream & sink);
+    Output(Output const & that) = delete;
+    Output & operator =(Output const & that) = delete;
+    ~Output();
+    /**
+     * Writes out everything submitted so far.
+     * It's a barrier for the interpreter exit: all the buffers should already be submitted.
+     */
+    void flush();
+
+    class Buffer {
+        friend Output;
+    public:
+        explicit Buffer(Output & output);
+        Buffer(Buffer const & that) = delete;
+        Buffer & operator =(Buffer const & that) = delete;
+        ~Buffer();
+        /**
+         * Must be called only by the thread owning the buffer.
+         */
+        void write(std::string && text);
+        /**
+         * Hands all the buffered pieces over to the output.
+         */
+        void submit();
+        [[nodiscard]] Output & getOutput() const;
+    private:
+        struct Piece {
+            uint64_t seq;
+            std::string text;
+        };
+
+        Output & output;
+        std::vector<Piece> pieces;
+        std::size_t size;
+        // A lower bound for the sequence number of the oldest piece which is not submitted yet, `NONE_PENDING` if there is no such piece.
+        std::atomic<uint64_t> oldestPending;
+    };
+private:
+    void submit(Buffer & buffer);
+    [[nodiscard]] uint64_t watermark() const;
+    void writeOut(uint64_t upTo);
+
+    static std::size_t const SUBMIT_THRESHOLD = 64 * 1024;
+    static uint64_t const NONE_PENDING = UINT64_MAX;
+
+    std::ostream & sink;
+    std::atomic<uint64_t> nextSeq;
+    std::mutex mutex; // guards everything below, and the sink
+    std::unordered_set<Buffer *> buffers;
+    std::vector<Buffer::Piece> submitted;
+};
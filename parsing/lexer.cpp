@@ -1,6 +1,7 @@
 #include "lexer.h"
 
 #include <cctype>
+#include <cstring>
 #include <cassert>
 #include <string>
 #include <string_view>
@@ -12,6 +13,9 @@ std::ostream & operator <<(std::ostream & out, Token::Kind const & kind) {
         case Token::Kind::TildEq: out << "`~=`"; break;
         case Token::Kind::Object: out << "`object`"; break;
         case Token::Kind::Thread: out << "`thread`"; break;
+        case Token::Kind::Repeat: out << "`repeat`"; break;
+        case Token::Kind::Join: out << "`join`"; break;
+        case Token::Kind::Checkpoint: out << "`checkpoint`"; break;
         case Token::Kind::LBrace: out << "`{`"; break;
         case Token::Kind::RBrace: out << "`}`"; break;
         case Token::Kind::LParenth: out << "`(`"; break;
@@ -19,7 +23,10 @@ std::ostream & operator <<(std::ostream & out, Token::Kind const & kind) {
         case Token::Kind::Sleep: out << "`sleep`"; break;
         case Token::Kind::Sleepr: out << "`sleepr`"; break;
         case Token::Kind::Dump: out << "`dump`"; break;
+        case Token::Kind::Stats: out << "`stats`"; break;
+        case Token::Kind::Freeze: out << "`freeze`"; break;
         case Token::Kind::Ident: out << "Identifier"; break;
+        case Token::Kind::String: out << "String"; break;
         case Token::Kind::Comment: out << "Comment"; break;
         case Token::Kind::Invalid: out << "Invalid token"; break;
         case Token::Kind::End: out << "End"; break;
@@ -38,12 +45,16 @@ Token::Token(Token::Kind kind, char const * begin, size_t len)
 Token::Token(Token::Kind kind, char const * begin, char const * end)
         : Token(kind, begin, std::distance(begin, end)) {}
 
-Lexer::Lexer(char const * prog) : remainder(prog) {}
+Lexer::Lexer(char const * prog, scan::Isa isa)
+        : Lexer(prog, prog + std::strlen(prog), isa) {}
+
+Lexer::Lexer(char const * text, char const * end, scan::Isa isa)
+        : remainder(text)
+        , textEnd(end)
+        , scanner(scan::get(isa)) {}
 
 Token Lexer::next() {
-    while (isspace(peek())) {
-        get();
-    }
+    remainder = scanner.spaces(remainder, textEnd);
 
     auto peeked = peek();
     if (peeked == '\0') {
@@ -64,6 +75,8 @@ Token Lexer::next() {
         return atom(Token::Kind::RParenth, ")");
     } else if (peeked == '/') {
         return comment();
+    } else if (peeked == '"') {
+        return string();
     } else if (isIdentChar(peeked)) {
         return word();
     } else {
@@ -87,7 +100,8 @@ char Lexer::get() {
 
 bool Lexer::isIdentChar(char peeked) {
     // we are OK with idents starting with a digit
-    return isalnum(peeked) || peeked == '_';
+    // `$` starts a placeholder for a loop counter
+    return isalnum(peeked) || peeked == '_' || peeked == '$';
 }
 
 Token Lexer::atom(Token::Kind kind, std::string const & exact) {
@@ -102,9 +116,7 @@ Token Lexer::comment() {
     char const * begin = remainder;
     get();
     assert(peek() == '/');
-    while (peek() != '\0' && peek() != '\n') {
-        get();
-    }
+    remainder = scanner.line(remainder, textEnd);
     char const * end = remainder;
     return {Token::Kind::Comment, begin, end};
 }
@@ -112,21 +124,50 @@ Token Lexer::comment() {
 Token Lexer::word() {
     char const * begin = remainder;
     assert(isIdentChar(peek()));
-    while (isIdentChar(peek())) {
-        get();
-    }
+    remainder = scanner.ident(remainder, textEnd);
     char const * end = remainder;
     auto word = std::string_view(begin, std::distance(begin, end));
-    if (word == "object") {
-        return {Token::Kind::Object, begin, end};
-    } else if (word == "thread") {
-        return {Token::Kind::Thread, begin, end};
-    } else if (word == "sleep") {
-        return {Token::Kind::Sleep, begin, end};
-    } else if (word == "sleepr") {
-        return {Token::Kind::Sleepr, begin, end};
-    } else if (word == "dump") {
-        return {Token::Kind::Dump, begin, end};
+    // most words are identifiers, so check the only keyword which can match first
+    auto kind = Token::Kind::Ident;
+    std::string_view keyword;
+    switch (word[0]) {
+        case 'o': kind = Token::Kind::Object; keyword = "object"; break;
+        case 't': kind = Token::Kind::Thread; keyword = "thread"; break;
+        case 'r': kind = Token::Kind::Repeat; keyword = "repeat"; break;
+        case 'j': kind = Token::Kind::Join; keyword = "join"; break;
+        case 'c': kind = Token::Kind::Checkpoint; keyword = "checkpoint"; break;
+        case 'd': kind = Token::Kind::Dump; keyword = "dump"; break;
+        case 'f': kind = Token::Kind::Freeze; keyword = "freeze"; break;
+        case 's':
+            if (word.length() == 6) {
+                kind = Token::Kind::Sleepr;
+                keyword = "sleepr";
+            } else if (word.length() > 1 && word[1] == 't') {
+                kind = Token::Kind::Stats;
+                keyword = "stats";
+            } else {
+                kind = Token::Kind::Sleep;
+                keyword = "sleep";
+            }
+            break;
+        default: break;
+    }
+    if (word != keyword) {
+        kind = Token::Kind::Ident;
+    }
+    return {kind, begin, end};
+}
+
+Token Lexer::string() {
+    assert(peek() == '"');
+    char const * begin = remainder;
+    get();
+    // no escapes, a string can not span several lines
+    remainder = scanner.stringBody(remainder, textEnd);
+    if (peek() != '"') {
+        return {Token::Kind::Invalid, begin, remainder};
     }
-    return {Token::Kind::Ident, begin, end};
+    get();
+    char const * end = remainder;
+    return {Token::Kind::String, begin, end};
 }
@@ -4,6 +4,8 @@
 #include <string>
 #include <string_view>
 
+#include "scan.h"
+
 class Token {
 public:
     enum class Kind {
@@ -12,6 +14,9 @@ public:
         TildEq,
         Object,
         Thread,
+        Repeat,
+        Join,
+        Checkpoint,
         LBrace,
         RBrace,
         LParenth,
@@ -19,7 +24,10 @@ public:
         Sleep,
         Sleepr,
         Dump,
+        Stats,
+        Freeze,
         Ident,
+        String,
         Comment,
         Invalid,
         End,
@@ -37,7 +45,14 @@ std::ostream & operator <<(std::ostream & out, Token::Kind const & kind);
 
 class Lexer {
 public:
-    explicit Lexer(const char * prog);
+    /**
+     * @param isa the instruction set to skip runs of characters with, the widest supported one by default.
+     */
+    explicit Lexer(const char * prog, scan::Isa isa = scan::best());
+    /**
+     * Starts in the middle of a text, `end` points to its terminating null.
+     */
+    Lexer(const char * text, const char * end, scan::Isa isa = scan::best());
     Token next();
 private:
     [[nodiscard]] char peek() const;
@@ -46,8 +61,11 @@ private:
     Token atom(Token::Kind, std::string const & exact);
     Token comment();
     Token word();
+    Token string();
 
     const char * remainder;
+    const char * textEnd; // the terminating null
+    scan::Scanner const & scanner;
 
     [[nodiscard]] static bool isIdentChar(char peeked) ;
 };
\ No newline at end of file
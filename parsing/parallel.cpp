@@ -0,0 +1,132 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+
+#include "parser.h"
+
+namespace {
+    /**
+     * Statements parsed from a chunk of the program.
+     */
+    struct Chunk {
+        std::size_t limit = 0; // statements starting here or later belong to the next chunk
+        std::vector<std::unique_ptr<ast::Statement>> statements;
+        std::vector<std::size_t> starts; // the offset of each statement
+        std::size_t end = 0; // the offset of the first token after the statements
+        std::exception_ptr error; // right after the statements
+    };
+
+    /**
+     * Splits the program into at most `count` chunks of about the same size,
+     * at line breaks outside of braces, comments and strings.
+     * @return the offsets of the chunks, followed by the size of the program.
+     */
+    std::vector<std::size_t> split(char const * prog, std::size_t size, uint count) {
+        std::vector<std::size_t> bounds{0};
+        long depth = 0;
+        char const * end = prog + size;
+        auto orEnd = [end](char const * found) { return found != nullptr ? found : end; };
+        for (auto p = orEnd(std::strpbrk(prog, "{}\"/\n")); p != end && bounds.size() < count; p = orEnd(std::strpbrk(p, "{}\"/\n"))) {
+            switch (*p) {
+                case '{':
+                    ++depth;
+                    ++p;
+                    break;
+                case '}':
+                    --depth;
+                    ++p;
+                    break;
+                case '"':
+                    // a string ends at a line break too
+                    p = orEnd(std::strpbrk(p + 1, "\"\n"));
+                    p += *p == '"' ? 1 : 0;
+                    break;
+                case '/':
+                    // the line break after a comment is looked at on the next step
+                    p = orEnd(std::strchr(p, '\n'));
+                    break;
+                default: {
+                    ++p;
+                    auto offset = static_cast<std::size_t>(p - prog);
+                    if (depth == 0 && offset >= size * bounds.size() / count && offset < size) {
+                        bounds.push_back(offset);
+                    }
+                }
+            }
+        }
+        bounds.push_back(size);
+        return bounds;
+    }
+
+    /**
+     * Parses statements starting at `from` into the chunk, up to its limit.
+     * If `known` is given, it's the chunk parsed before from a place which may be wrong,
+     * and its statements are taken as is as soon as one of them starts right where the parser is.
+     */
+    void parseChunk(char const * prog, std::size_t size, std::size_t from, ast::Arena & arena, Chunk & chunk, Chunk * known) {
+        ast::Arena::Scope scope(arena);
+        Parser parser(prog, size, from);
+        std::size_t next = 0; // the first statement of `known` the parser hasn't passed yet
+        try {
+            while (parser.hasNext() && parser.offset() < chunk.limit) {
+                auto start = parser.offset();
+                if (known != nullptr) {
+                    while (next < known->starts.size() && known->starts[next] < start) {
+                        ++next;
+                    }
+                    if (next < known->starts.size() && known->starts[next] == start) {
+                        std::move(known->statements.begin() + next, known->statements.end(), std::back_inserter(chunk.statements));
+                        chunk.starts.insert(chunk.starts.end(), known->starts.begin() + next, known->starts.end());
+                        chunk.end = known->end;
+                        chunk.error = known->error;
+                        return;
+                    }
+                }
+                chunk.statements.push_back(parser.nextStatement());
+                chunk.starts.push_back(start);
+            }
+        } catch (...) {
+            chunk.error = std::current_exception();
+        }
+        chunk.end = parser.offset();
+    }
+}
+
+ParsedProgram parseParallel(char const * prog, uint workers, std::size_t minChunk) {
+    auto size = std::strlen(prog);
+    auto count = std::clamp<std::size_t>(size / std::max<std::size_t>(minChunk, 1), 1, std::max(workers, 1u));
+    auto bounds = split(prog, size, count);
+
+    ParsedProgram program;
+    std::vector<Chunk> chunks(bounds.size() - 1);
+    for (std::size_t k = 0; k < chunks.size(); ++k) {
+        program.arenas.push_back(std::make_unique<ast::Arena>());
+        chunks[k].limit = bounds[k + 1];
+    }
+    std::vector<std::thread> threads;
+    for (std::size_t k = 1; k < chunks.size(); ++k) {
+        threads.emplace_back(parseChunk, prog, size, bounds[k], std::ref(*program.arenas[k]), std::ref(chunks[k]), nullptr);
+    }
+    parseChunk(prog, size, 0, *program.arenas[0], chunks[0], nullptr);
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    // the first chunk starts right, and each next one is checked to start where the previous one ends
+    for (std::size_t k = 0; k < chunks.size(); ++k) {
+        if (k > 0) {
+            Chunk checked;
+            checked.limit = chunks[k].limit;
+            parseChunk(prog, size, chunks[k - 1].end, *program.arenas[0], checked, &chunks[k]);
+            chunks[k] = std::move(checked);
+        }
+        std::move(chunks[k].statements.begin(), chunks[k].statements.end(), std::back_inserter(program.statements));
+        if (chunks[k].error) {
+            std::rethrow_exception(chunks[k].error);
+        }
+    }
+    return program;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../ast.h"
+
+/**
+ * Statements of a whole program, along with the arenas holding their nodes.
+ */
+struct ParsedProgram {
+    ParsedProgram() = default;
+    ParsedProgram(ParsedProgram && that) = default;
+    // would free the arenas before the statements in them
+    ParsedProgram & operator =(ParsedProgram && that) = delete;
+
+    // declared first, to be released last
+    std::vector<std::unique_ptr<ast::Arena>> arenas;
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+};
+
+/**
+ * Parses a program on several threads.
+ * The program is split into chunks of at least `minChunk` bytes, one per worker, at line breaks outside of any braces,
+ * and each chunk is parsed on its own, as if it started with a top-level statement.
+ * A chunk which actually starts inside a statement can't meet the statements of the previous chunk,
+ * and is parsed once more from where the previous chunk ends, until the two agree on a statement boundary.
+ * So the result, as well as the first syntax error, is exactly the same as of the sequential parser.
+ */
+ParsedProgram parseParallel(char const * prog, uint workers = std::thread::hardware_concurrency(), std::size_t minChunk = 1 << 20);
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <sstream>
 #include "parser.h"
 #include "../ast.h"
@@ -20,10 +22,21 @@ Parser::Parser(char const * prog)
     consumeToken();
 }
 
+Parser::Parser(char const * prog, std::size_t size, std::size_t from)
+        : prog(prog)
+        , lexer(prog + from, prog + size)
+        , nextToken() {
+    consumeToken();
+}
+
 bool Parser::hasNext() const {
     return nextToken.kind != Token::Kind::End;
 }
 
+std::size_t Parser::offset() const {
+    return nextToken.range.data() - prog;
+}
+
 std::unique_ptr<ast::Statement> Parser::nextStatement() {
     assert(hasNext());
     assert(nextToken.kind != Token::Kind::Comment);
@@ -90,13 +103,20 @@ Token Parser::consumeToken() {
 }
 
 std::unique_ptr<ast::Statement> Parser::statement(bool topLevel) {
-    if (nextToken.kind == Token::Kind::Thread) {
-        if (topLevel) {
-            return newThread();
+    if (nextToken.kind == Token::Kind::Thread || nextToken.kind == Token::Kind::Join || nextToken.kind == Token::Kind::Checkpoint) {
+        if (!topLevel) {
+            throw makeExpectedFoundError({Token::Kind::Repeat, Token::Kind::Sleep, Token::Kind::Sleepr, Token::Kind::Dump, Token::Kind::Stats, Token::Kind::Freeze, Token::Kind::Ident});
+        } else if (nextToken.kind == Token::Kind::Thread) {
+            return newThread("");
+        } else if (nextToken.kind == Token::Kind::Join) {
+            return join();
         } else {
-            throw makeExpectedFoundError({Token::Kind::Sleep, Token::Kind::Sleepr, Token::Kind::Dump, Token::Kind::Ident});
+            return checkpoint();
         }
     }
+    if (nextToken.kind == Token::Kind::Repeat) {
+        return repeat(topLevel);
+    }
     if (nextToken.kind == Token::Kind::Sleep) {
         consumeToken({Token::Kind::Sleep});
         return std::make_unique<ast::Sleep>();
@@ -105,13 +125,29 @@ std::unique_ptr<ast::Statement> Parser::statement(bool topLevel) {
         consumeToken({Token::Kind::Sleepr});
         return std::make_unique<ast::Sleepr>();
     }
+    if (nextToken.kind == Token::Kind::Stats) {
+        consumeToken({Token::Kind::Stats});
+        return std::make_unique<ast::Stats>();
+    }
     if (nextToken.kind == Token::Kind::Dump) {
         consumeToken({Token::Kind::Dump});
         return std::make_unique<ast::Dump>(expression());
     }
+    if (nextToken.kind == Token::Kind::Freeze) {
+        consumeToken({Token::Kind::Freeze});
+        return std::make_unique<ast::Freeze>(expression());
+    }
     // assignments
     auto to = assignableTo();
     auto assignOp = consumeToken({Token::Kind::Eq, Token::Kind::TildEq});
+    if (nextToken.kind == Token::Kind::Thread) {
+        // a thread handle
+        auto handle = dynamic_cast<ast::Var *>(to.get());
+        if (!topLevel || assignOp.kind != Token::Kind::Eq || handle == nullptr) {
+            throw makeExpectedFoundError({Token::Kind::Object, Token::Kind::Ident});
+        }
+        return newThread(handle->name);
+    }
     auto from = expression();
 
     if (assignOp.kind == Token::Kind::Eq) {
@@ -123,7 +159,7 @@ std::unique_ptr<ast::Statement> Parser::statement(bool topLevel) {
     }
 }
 
-std::unique_ptr<ast::NewThread> Parser::newThread() {
+std::unique_ptr<ast::NewThread> Parser::newThread(std::string const & handle) {
     consumeToken({Token::Kind::Thread});
     consumeToken({Token::Kind::LBrace});
 
@@ -134,7 +170,67 @@ std::unique_ptr<ast::NewThread> Parser::newThread() {
     }
     consumeToken({Token::Kind::RBrace});
 
-    return std::make_unique<ast::NewThread>(std::move(body));
+    return std::make_unique<ast::NewThread>(handle, std::move(body));
+}
+
+std::unique_ptr<ast::Join> Parser::join() {
+    consumeToken({Token::Kind::Join});
+    auto handle = ident();
+    if (handle == "all") {
+        return std::make_unique<ast::Join>("");
+    }
+    return std::make_unique<ast::Join>(handle);
+}
+
+std::unique_ptr<ast::Checkpoint> Parser::checkpoint() {
+    consumeToken({Token::Kind::Checkpoint});
+    auto quoted = consumeToken({Token::Kind::String}).range;
+    return std::make_unique<ast::Checkpoint>(std::string(quoted.substr(1, quoted.length() - 2)));
+}
+
+std::unique_ptr<ast::Repeat> Parser::repeat(bool topLevel) {
+    consumeToken({Token::Kind::Repeat});
+    auto times = number();
+    std::string counter = "i";
+    auto [line, posInLine] = lineAndPos();
+    if (nextToken.kind == Token::Kind::Ident) {
+        counter = ident();
+    }
+    for (auto & outer : counters) {
+        // placeholders are substituted by prefix, `$ab` would be taken for `$a` followed by `b`
+        auto shorter = std::min(outer.length(), counter.length());
+        if (outer != counter && outer.compare(0, shorter, counter, 0, shorter) == 0) {
+            throw SyntaxError(line, posInLine, "the counter " + counter + " shares a prefix with the counter " + outer + " of an enclosing loop");
+        }
+    }
+    consumeToken({Token::Kind::LBrace});
+    counters.push_back(counter);
+
+    auto body = std::vector<std::unique_ptr<ast::Statement>>();
+    while (nextToken.kind != Token::Kind::RBrace) {
+        // a loop can start threads only if it's allowed in the place of the loop itself
+        auto stat = statement(topLevel);
+        body.push_back(std::move(stat));
+    }
+    consumeToken({Token::Kind::RBrace});
+    counters.pop_back();
+
+    return std::make_unique<ast::Repeat>(times, counter, std::move(body));
+}
+
+uint Parser::number() {
+    requireNext({Token::Kind::Ident});
+    auto digits = nextToken.range;
+    bool isNumber = digits.length() <= 9; // to fit into `uint`
+    for (auto c : digits) {
+        isNumber = isNumber && std::isdigit(c);
+    }
+    if (!isNumber) {
+        auto [line, posInLine] = lineAndPos();
+        throw SyntaxError(line, posInLine, "expected a number, found " + std::string(digits));
+    }
+    consumeToken();
+    return std::stoul(std::string(digits));
 }
 
 std::unique_ptr<ast::AssignableTo> Parser::assignableTo() {
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "lexer.h"
 #include "../ast.h"
@@ -17,8 +18,17 @@ private:
 class Parser {
 public:
     explicit Parser(char const * prog);
+    /**
+     * Parses the program of `size` bytes from `from` on, which should be the start of a top-level statement.
+     * Offsets and positions in errors are still counted from the beginning of the program.
+     */
+    Parser(char const * prog, std::size_t size, std::size_t from);
     std::unique_ptr<ast::Statement> nextStatement();
     [[nodiscard]] bool hasNext() const;
+    /**
+     * The offset in the program of the next statement, or of its end.
+     */
+    [[nodiscard]] std::size_t offset() const;
 private:
     Token consumeToken(std::initializer_list<Token::Kind> kinds);
     void requireNext(std::initializer_list<Token::Kind> kinds) const;
@@ -26,7 +36,11 @@ private:
     [[nodiscard]] std::pair<uint, uint> lineAndPos() const;
     Token consumeToken();
     std::unique_ptr<ast::Statement> statement(bool topLevel);
-    std::unique_ptr<ast::NewThread> newThread();
+    std::unique_ptr<ast::NewThread> newThread(std::string const & handle);
+    std::unique_ptr<ast::Join> join();
+    std::unique_ptr<ast::Checkpoint> checkpoint();
+    std::unique_ptr<ast::Repeat> repeat(bool topLevel);
+    uint number();
     std::unique_ptr<ast::AssignableTo> assignableTo();
     std::unique_ptr<ast::Expression> expression();
     std::string ident();
@@ -34,4 +48,5 @@ private:
     char const * prog;
     Lexer lexer;
     Token nextToken;
+    std::vector<std::string> counters; // of the loops being parsed, outermost first
 };
\ No newline at end of file
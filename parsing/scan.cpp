@@ -0,0 +1,105 @@
+#include "scan.h"
+#include "scan_impl.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define ARC_SCAN_X86
+#endif
+
+namespace {
+    template<bool (* inClass)(unsigned char)>
+    char const * skipScalar(char const * text, char const * end) {
+        while (inClass(*text)) {
+            ++text;
+        }
+        return text;
+    }
+
+    scan::Scanner const scalarScanner = {
+        scan::Isa::Scalar,
+        skipScalar<isSpace>,
+        skipScalar<isIdent>,
+        skipScalar<isInLine>,
+        skipScalar<isInString>,
+    };
+
+#ifdef ARC_SCAN_X86
+    __m128i load(char const * text) {
+        return _mm_loadu_si128(reinterpret_cast<__m128i const *>(text));
+    }
+
+    // unsigned `low <= c <= high`, per character
+    __m128i inRange(__m128i chars, char low, char high) {
+        auto shifted = _mm_sub_epi8(chars, _mm_set1_epi8(low));
+        return _mm_cmpeq_epi8(_mm_subs_epu8(shifted, _mm_set1_epi8(static_cast<char>(high - low))), _mm_setzero_si128());
+    }
+
+    uint32_t bits(__m128i matches) {
+        return static_cast<uint32_t>(_mm_movemask_epi8(matches));
+    }
+
+    uint32_t spaces(char const * text) {
+        auto chars = load(text);
+        return bits(_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), inRange(chars, '\t', '\r')));
+    }
+
+    uint32_t ident(char const * text) {
+        auto chars = load(text);
+        auto letters = inRange(_mm_or_si128(chars, _mm_set1_epi8(0x20)), 'a', 'z');
+        auto digits = inRange(chars, '0', '9');
+        auto others = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('_')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('$')));
+        return bits(_mm_or_si128(_mm_or_si128(letters, digits), others));
+    }
+
+    uint32_t lineEnds(__m128i chars) {
+        return bits(_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chars, _mm_setzero_si128())));
+    }
+
+    uint32_t line(char const * text) {
+        return ~lineEnds(load(text));
+    }
+
+    uint32_t stringBody(char const * text) {
+        auto chars = load(text);
+        return ~(lineEnds(chars) | bits(_mm_cmpeq_epi8(chars, _mm_set1_epi8('"'))));
+    }
+
+    scan::Scanner const sse2Scanner = {
+        scan::Isa::Sse2,
+        skipWhile<16, spaces, isSpace>,
+        skipWhile<16, ident, isIdent>,
+        skipWhile<16, line, isInLine>,
+        skipWhile<16, stringBody, isInString>,
+    };
+#endif
+}
+
+#ifdef ARC_SCAN_X86
+namespace scan {
+    // built for AVX2 in a translation unit of its own
+    extern Scanner const avx2Scanner;
+}
+#endif
+
+scan::Isa scan::best() {
+#ifdef ARC_SCAN_X86
+    static Isa const isa = __builtin_cpu_supports("avx2") ? Isa::Avx2 : Isa::Sse2;
+    return isa;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+scan::Scanner const & scan::get(Isa isa) {
+    auto supported = best();
+    if (isa > supported) {
+        isa = supported;
+    }
+    switch (isa) {
+#ifdef ARC_SCAN_X86
+        case Isa::Avx2: return avx2Scanner;
+        case Isa::Sse2: return sse2Scanner;
+#endif
+        default: return scalarScanner;
+    }
+}
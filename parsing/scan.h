@@ -0,0 +1,37 @@
+#pragma once
+
+/**
+ * Skipping runs of characters of the same class, the hot loops of the lexer.
+ * Each function gets a pointer into a null-terminated text along with the pointer to its null,
+ * and returns a pointer to the first character not in the run.
+ * Vectorized versions classify a whole register of characters at once, and never read past the end.
+ */
+namespace scan {
+    enum class Isa {
+        Scalar,
+        Sse2,
+        Avx2,
+    };
+
+    struct Scanner {
+        Isa isa;
+        // whitespace, as `isspace` sees it in the "C" locale
+        char const * (* spaces)(char const * text, char const * end);
+        // letters, digits, `_` and `$`
+        char const * (* ident)(char const * text, char const * end);
+        // up to a line break or the end of the text
+        char const * (* line)(char const * text, char const * end);
+        // up to a line break, `"` or the end of the text
+        char const * (* stringBody)(char const * text, char const * end);
+    };
+
+    /**
+     * The widest instruction set the CPU supports.
+     */
+    Isa best();
+
+    /**
+     * Falls back to a narrower instruction set if the CPU doesn't support the requested one.
+     */
+    Scanner const & get(Isa isa);
+}
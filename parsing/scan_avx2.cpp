@@ -0,0 +1,61 @@
+// compiled with `-mavx2`, so nothing here may run before `scan::best` confirms the CPU supports it
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#include "scan.h"
+#include "scan_impl.h"
+
+namespace {
+    __m256i load(char const * text) {
+        return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(text));
+    }
+
+    // unsigned `low <= c <= high`, per character
+    __m256i inRange(__m256i chars, char low, char high) {
+        auto shifted = _mm256_sub_epi8(chars, _mm256_set1_epi8(low));
+        return _mm256_cmpeq_epi8(_mm256_subs_epu8(shifted, _mm256_set1_epi8(static_cast<char>(high - low))), _mm256_setzero_si256());
+    }
+
+    uint32_t bits(__m256i matches) {
+        return static_cast<uint32_t>(_mm256_movemask_epi8(matches));
+    }
+
+    uint32_t spaces(char const * text) {
+        auto chars = load(text);
+        return bits(_mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')), inRange(chars, '\t', '\r')));
+    }
+
+    uint32_t ident(char const * text) {
+        auto chars = load(text);
+        auto letters = inRange(_mm256_or_si256(chars, _mm256_set1_epi8(0x20)), 'a', 'z');
+        auto digits = inRange(chars, '0', '9');
+        auto others = _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('$')));
+        return bits(_mm256_or_si256(_mm256_or_si256(letters, digits), others));
+    }
+
+    uint32_t lineEnds(__m256i chars) {
+        return bits(_mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(chars, _mm256_setzero_si256())));
+    }
+
+    uint32_t line(char const * text) {
+        return ~lineEnds(load(text));
+    }
+
+    uint32_t stringBody(char const * text) {
+        auto chars = load(text);
+        return ~(lineEnds(chars) | bits(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('"'))));
+    }
+}
+
+namespace scan {
+    extern Scanner const avx2Scanner = {
+        Isa::Avx2,
+        skipWhile<32, spaces, isSpace>,
+        skipWhile<32, ident, isIdent>,
+        skipWhile<32, line, isInLine>,
+        skipWhile<32, stringBody, isInString>,
+    };
+}
+
+#endif
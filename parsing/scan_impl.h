@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "scan.h"
+
+/**
+ * The parts shared by all the implementations of `scan`.
+ * Translation units compiled for different instruction sets include them, so everything here has internal linkage:
+ * the linker must not substitute a copy built for a wider instruction set.
+ */
+namespace {
+    bool isSpace(unsigned char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    bool isIdent(unsigned char c) {
+        // the same as `isalnum` in the "C" locale, along with `_` and the counter placeholder `$`
+        auto lower = static_cast<unsigned char>(c | 0x20);
+        return (lower >= 'a' && lower <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '$';
+    }
+
+    bool isInLine(unsigned char c) {
+        return c != '\n' && c != '\0';
+    }
+
+    bool isInString(unsigned char c) {
+        return isInLine(c) && c != '"';
+    }
+
+    /**
+     * Skips the characters of a class, `WIDTH` characters at a time while they are all before `end`.
+     * `mask` sets a bit for each of the `WIDTH` characters it gets in the class.
+     */
+    template<unsigned WIDTH, uint32_t (* mask)(char const *), bool (* inClass)(unsigned char)>
+    char const * skipWhile(char const * text, char const * end) {
+        uint32_t const all = WIDTH == 32 ? UINT32_MAX : (1u << WIDTH) - 1;
+        while (end - text >= WIDTH) {
+            auto outOfClass = ~mask(text) & all;
+            if (outOfClass != 0) {
+                return text + __builtin_ctz(outOfClass);
+            }
+            text += WIDTH;
+        }
+        // the terminating null is never in the class
+        while (inClass(*text)) {
+            ++text;
+        }
+        return text;
+    }
+}
@@ -0,0 +1,126 @@
+#include "perf.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::array<char const *, 4> const PerfCounters::NAMES = {"cycles", "instructions", "cache-misses", "branch-misses"};
+
+PerfCounts operator -(PerfReadings const & later, PerfReadings const & earlier) {
+    PerfCounts diff;
+    for (std::size_t k = 0; k < diff.size(); ++k) {
+        if (!later[k] || !earlier[k]) {
+            continue;
+        }
+        // the raw values and the times only grow, so only their differences are scaled, never the totals
+        auto value = later[k]->value - earlier[k]->value;
+        auto enabled = later[k]->enabled - earlier[k]->enabled;
+        auto running = later[k]->running - earlier[k]->running;
+        if (running == 0) {
+            diff[k] = 0;
+        } else if (running < enabled) {
+            diff[k] = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+        } else {
+            diff[k] = value;
+        }
+    }
+    return diff;
+}
+
+PerfCounters::PerfCounters() : fds(), error() {
+    std::array<uint64_t, 4> const configs = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (std::size_t k = 0; k < fds.size(); ++k) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[k];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // the kernel multiplexes the events if there are not enough counters, the differences are scaled then
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fds[k] < 0 && error.empty()) {
+            error = std::string(NAMES[k]) + ": " + std::strerror(errno);
+        }
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (auto fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+PerfReadings PerfCounters::read() const {
+    PerfReadings readings;
+    for (std::size_t k = 0; k < fds.size(); ++k) {
+        uint64_t values[3]; // the value, the time enabled and the time running
+        if (fds[k] < 0 || ::read(fds[k], values, sizeof(values)) != sizeof(values)) {
+            continue;
+        }
+        readings[k] = PerfReading{values[0], values[1], values[2]};
+    }
+    return readings;
+}
+
+std::string const & PerfCounters::getError() const {
+    return error;
+}
+
+thread_local PerfReport * PerfReport::current = nullptr;
+
+void PerfReport::add(std::string const & what, PerfCounts const & counts) {
+    std::lock_guard<std::mutex> lock(mutex);
+    rows.emplace_back(what, counts);
+}
+
+void PerfReport::addThread(PerfCounts const & counts) {
+    std::lock_guard<std::mutex> lock(mutex);
+    threads += 1;
+    rows.emplace_back("thread " + std::to_string(threads), counts);
+}
+
+void PerfReport::print(std::ostream & out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error.empty()) {
+        out << "perf counters: not all events are counted (" << error << ")" << std::endl;
+    }
+    out << std::left << std::setw(14) << "perf counters";
+    for (auto name : PerfCounters::NAMES) {
+        out << std::right << std::setw(16) << name;
+    }
+    out << std::endl;
+    for (auto & [what, counts] : rows) {
+        out << std::left << std::setw(14) << what;
+        for (auto & count : counts) {
+            out << std::right << std::setw(16);
+            if (count) {
+                out << *count;
+            } else {
+                out << "n/a";
+            }
+        }
+        out << std::endl;
+    }
+}
+
+ThreadPerf::ThreadPerf() : report(PerfReport::current), counters(), start() {
+    if (report != nullptr) {
+        counters.emplace();
+        start = counters->read();
+    }
+}
+
+ThreadPerf::~ThreadPerf() {
+    if (report != nullptr) {
+        report->addThread(counters->read() - start);
+    }
+}
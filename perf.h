@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Counts of hardware events, missing for the events which couldn't be counted.
+ */
+using PerfCounts = std::array<std::optional<uint64_t>, 4>;
+
+/**
+ * What the kernel reports for an event: the raw count, and how long the event was enabled and actually counted.
+ * The times differ when the kernel multiplexes the events over too few counters.
+ */
+struct PerfReading {
+    uint64_t value;
+    uint64_t enabled;
+    uint64_t running;
+};
+
+using PerfReadings = std::array<std::optional<PerfReading>, 4>;
+
+/**
+ * The counts between two readings, each scaled by the share of that interval its event was counted in.
+ */
+PerfCounts operator -(PerfReadings const & later, PerfReadings const & earlier);
+
+/**
+ * Cycles, instructions, cache misses and branch misses of the calling thread, in user space, read with `perf_event_open`.
+ * Events the kernel or the CPU doesn't count, e.g. all of them in most containers and VMs, are left out.
+ */
+class PerfCounters {
+public:
+    PerfCounters();
+    PerfCounters(PerfCounters const & that) = delete;
+    PerfCounters & operator =(PerfCounters const & that) = delete;
+    ~PerfCounters();
+
+    [[nodiscard]] PerfReadings read() const;
+    /**
+     * Why the first of the missing events is missing, empty if none is.
+     */
+    [[nodiscard]] std::string const & getError() const;
+
+    static std::array<char const *, 4> const NAMES;
+private:
+    std::array<int, 4> fds;
+    std::string error;
+};
+
+/**
+ * Counts of the phases of a program and of the threads it starts.
+ */
+class PerfReport {
+public:
+    void add(std::string const & what, PerfCounts const & counts);
+    void addThread(PerfCounts const & counts);
+    void print(std::ostream & out) const;
+
+    std::string error; // why some events are not counted
+
+    /**
+     * The report of the program run by the current thread, if anyone is interested in it.
+     * Interpreter threads inherit it from the thread which starts them.
+     */
+    static thread_local PerfReport * current;
+private:
+    mutable std::mutex mutex;
+    std::vector<std::pair<std::string, PerfCounts>> rows;
+    std::size_t threads = 0;
+};
+
+/**
+ * Counts the events of the calling thread while it's in scope, if there's a report to add them to.
+ */
+class ThreadPerf {
+public:
+    ThreadPerf();
+    ~ThreadPerf();
+private:
+    PerfReport * report;
+    std::optional<PerfCounters> counters;
+    PerfReadings start;
+};
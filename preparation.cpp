@@ -1,79 +1,1574 @@
 #include "preparation.h"
 #include "ast.h"
+#include "logger.h"
 
 #include <iostream>
 #include <unordered_set>
-#include <forward_list>
+#include <unordered_map>
+#include <iterator>
+#include <algorithm>
+#include <optional>
+#include <map>
+#include <set>
+#include <cstdint>
 #include <cassert>
+#include <cctype>
+#include <numeric>
+#include <sstream>
+
+/**
+ * Whether every one of the counters has its placeholder in some of the names.
+ */
+template<typename Names>
+bool mentionsAll(Names const & names, std::vector<std::string> const & counters) {
+    return std::all_of(counters.begin(), counters.end(), [&](std::string const & counter) {
+        auto placeholder = "$" + counter;
+        return std::any_of(names.begin(), names.end(), [&](std::string const & name) {
+            return name.find(placeholder) != std::string::npos;
+        });
+    });
+}
 
 class UsageFinder : public ast::Statement::Visitor, public ast::Expression::Visitor {
 public:
+    /**
+     * @param expandLoops whether to substitute the counters of the loops inside the visited statement,
+     * otherwise the names are left as they are written.
+     */
+    explicit UsageFinder(bool expandLoops = true) : expandLoops(expandLoops) {}
+
+    /**
+     * Names are left relative to the loops enclosing the visited statement,
+     * counters of the loops inside it are substituted.
+     */
     std::unordered_set<std::string> usedVars;
 private:
+    bool expandLoops;
+    ast::Repeat::Counters counters;
+    // of the loops past their first iteration, only the statements using all of them can add new names
+    std::vector<std::string> settled;
+
     void visitAssign(ast::Assign & assign) override {
         assign.to->accept(*this);
         assign.from->accept(*this);
     }
 
     void visitNewThread(ast::NewThread & newThread) override {
-        for (auto & stat : newThread.body) {
+        for (auto & stat : *newThread.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        if (!expandLoops) {
+            for (auto & stat : repeat.body) {
+                stat->accept(*this);
+            }
+            return;
+        }
+        if (repeat.times == 0) {
+            return;
+        }
+        counters.emplace_back(repeat.counter, 0);
+        for (auto stat : usingSettled(repeat.body)) {
+            stat->accept(*this);
+        }
+        // the statements which don't use the counter find the same names in every iteration
+        settled.push_back(repeat.counter);
+        auto varying = usingSettled(repeat.body);
+        for (uint i = 1; i < repeat.times && !varying.empty(); ++i) {
+            counters.back().second = i;
+            for (auto stat : varying) {
+                stat->accept(*this);
+            }
+        }
+        settled.pop_back();
+        counters.pop_back();
+    }
+
+    std::vector<ast::Statement *> usingSettled(std::vector<std::unique_ptr<ast::Statement>> const & body) const {
+        std::vector<ast::Statement *> result;
+        for (auto & stat : body) {
+            auto written = UsageFinder(false);
+            stat->accept(written);
+            if (mentionsAll(written.usedVars, settled)) {
+                result.push_back(stat.get());
+            }
+        }
+        return result;
+    }
+
+    void visitJoin(ast::Join & join) override {}
+
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override {}
+
+    void visitSleep(ast::Sleep & sleep) override {}
+
+    void visitSleepr(ast::Sleepr & sleepr) override {}
+
+    void visitStats(ast::Stats & stats) override {}
+
+    void visitFreeze(ast::Freeze & freeze) override {
+        freeze.expr->accept(*this);
+    }
+
+    void visitDump(ast::Dump & dump) override {
+        dump.expr->accept(*this);
+    }
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {}
+
+    void visitNewObject(ast::NewObject & newObject) override {}
+
+    void visitVar(ast::Var & var) override {
+        if (counters.empty()) {
+            usedVars.insert(var.name);
+        } else {
+            usedVars.insert(ast::Repeat::expand(var.name, counters));
+        }
+    }
+
+    void visitSelectField(ast::SelectField & selectField) override {
+        selectField.obj->accept(*this);
+    }
+};
+
+/**
+ * Finds the variable an expression starts with, or the allocation site it is.
+ */
+class RootFinder : public ast::Expression::Visitor {
+public:
+    explicit RootFinder(ast::Expression & expr) {
+        expr.accept(*this);
+    }
+
+    std::string var;
+    ast::NewObject * site = nullptr;
+private:
+    void visitNewObject(ast::NewObject & newObject) override {
+        site = &newObject;
+    }
+
+    void visitVar(ast::Var & var) override {
+        this->var = var.name;
+    }
+
+    void visitSelectField(ast::SelectField & selectField) override {
+        selectField.obj->accept(*this);
+    }
+};
+
+using Body = std::vector<std::unique_ptr<ast::Statement>>;
+
+/**
+ * References flowing from a variable or an allocation site into (the objects of) a variable.
+ */
+struct Flow {
+    std::size_t to; // index in `Leaf::usedVars`
+    std::size_t from; // index in `Leaf::usedVars` or in `LeafCollector::sites`
+    bool fromSite;
+};
+
+/**
+ * A statement which is not a loop, along with its place in the program.
+ */
+struct Leaf {
+    std::size_t step;
+    std::size_t topLevelStep;
+    bool isCheckpoint;
+    ast::NewThread * thread; // if the leaf starts one
+    // the variables the statement uses, relative to the enclosing loops
+    std::vector<std::string> usedVars;
+    std::vector<Flow> flows;
+    // per used variable, whether every iteration of the enclosing loops uses it for the last time
+    std::vector<bool> diesInEveryIteration;
+    bool executed = false;
+};
+
+/**
+ * A leaf or a loop.
+ */
+struct Step {
+    std::size_t leaf;
+    ast::Repeat * loop; // `nullptr` for a leaf
+    std::vector<std::size_t> body; // of the loop, indices of the steps
+    std::vector<std::string> markersAfter; // the variables to place `EndOfLife` for right after the step
+};
+
+/**
+ * Flattens the program into leaves and loops, finding the variables each leaf uses once,
+ * no matter how many times it's executed.
+ * Threads get their capture sets here as well.
+ */
+class LeafCollector : public ast::Statement::Visitor {
+public:
+    explicit LeafCollector(Body & prog) {
+        leaves.reserve(prog.size());
+        steps.reserve(prog.size());
+        body = &topLevel;
+        for (auto & stat : prog) {
+            topLevelStep = steps.size();
+            stat->accept(*this);
+        }
+    }
+
+    std::vector<Leaf> leaves;
+    std::vector<Step> steps;
+    std::vector<std::size_t> topLevel;
+    std::vector<ast::NewObject *> sites; // outside of threads
+private:
+    std::size_t topLevelStep = 0;
+    std::vector<std::size_t> * body = nullptr;
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        auto stepId = steps.size();
+        body->push_back(stepId);
+        steps.push_back({0, &repeat, {}, {}});
+
+        std::vector<std::size_t> loopSteps;
+        auto outerBody = body;
+        body = &loopSteps;
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+        body = outerBody;
+        steps[stepId].body = std::move(loopSteps);
+    }
+
+    void visitNewThread(ast::NewThread & newThread) override {
+        auto & leaf = addLeaf(newThread, false);
+        leaf.thread = &newThread;
+        auto & usedVars = leaf.usedVars;
+        // names stay relative to the enclosing loops, the interpreter substitutes their counters on the thread start
+        *newThread.usedVars = std::unordered_set<std::string>(usedVars.begin(), usedVars.end());
+    }
+
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override {
+        addLeaf(checkpoint, true);
+    }
+
+    void visitAssign(ast::Assign & assign) override {
+        auto & leaf = addLeaf(assign, false);
+        auto to = RootFinder(*assign.to);
+        auto from = RootFinder(*assign.from);
+        if (from.site != nullptr) {
+            leaf.flows.push_back({indexOf(leaf, to.var), sites.size(), true});
+            sites.push_back(from.site);
+        } else {
+            leaf.flows.push_back({indexOf(leaf, to.var), indexOf(leaf, from.var), false});
+        }
+    }
+
+    void visitDump(ast::Dump & dump) override {
+        addLeaf(dump, false);
+        auto root = RootFinder(*dump.expr);
+        if (root.site != nullptr) {
+            sites.push_back(root.site); // flows nowhere
+        }
+    }
+
+    void visitFreeze(ast::Freeze & freeze) override {
+        addLeaf(freeze, false);
+        auto root = RootFinder(*freeze.expr);
+        if (root.site != nullptr) {
+            sites.push_back(root.site); // flows nowhere
+        }
+    }
+
+    void visitStatement(ast::Statement & stat) override {
+        addLeaf(stat, false);
+    }
+
+    static std::size_t indexOf(Leaf const & leaf, std::string const & var) {
+        auto found = std::find(leaf.usedVars.begin(), leaf.usedVars.end(), var);
+        assert(found != leaf.usedVars.end());
+        return found - leaf.usedVars.begin();
+    }
+
+    Leaf & addLeaf(ast::Statement & stat, bool isCheckpoint) {
+        auto usageFinder = UsageFinder();
+        stat.accept(usageFinder);
+        body->push_back(steps.size());
+        auto & leaf = leaves.emplace_back();
+        leaf.step = steps.size();
+        leaf.topLevelStep = topLevelStep;
+        steps.push_back({leaves.size() - 1, nullptr, {}, {}});
+        leaf.isCheckpoint = isCheckpoint;
+        leaf.thread = nullptr;
+        leaf.usedVars.assign(usageFinder.usedVars.begin(), usageFinder.usedVars.end());
+        leaf.diesInEveryIteration.assign(leaf.usedVars.size(), true);
+        return leaf;
+    }
+};
+
+/**
+ * Escape analysis: groups the variables and allocation sites which may reference the same objects.
+ * References are unified regardless of the direction and the order of the statements,
+ * so all the objects reachable from a variable stay in its region.
+ * A region escapes if a thread captures any of its variables,
+ * objects from the allocation sites of other regions are never seen by other threads.
+ */
+class Regions {
+public:
+    explicit Regions(std::size_t sites) {
+        for (std::size_t i = 0; i < sites; ++i) {
+            siteNodes.push_back(newNode());
+        }
+    }
+
+    void addVar() {
+        varNodes.push_back(newNode());
+    }
+
+    /**
+     * The variable can be seen by the code which is not known yet.
+     */
+    void escape(uint32_t id) {
+        escaped[varNodes[id]] = true;
+    }
+
+    void visit(Leaf const & leaf, std::vector<uint32_t> const & usedIds) {
+        if (leaf.thread != nullptr) {
+            for (auto id : usedIds) {
+                escaped[varNodes[id]] = true;
+            }
+        }
+        for (auto & flow : leaf.flows) {
+            auto from = flow.fromSite ? siteNodes[flow.from] : varNodes[usedIds[flow.from]];
+            unite(varNodes[usedIds[flow.to]], from);
+        }
+    }
+
+    void markSites(std::vector<ast::NewObject *> const & sites) {
+        std::vector<bool> regionEscaped(parents.size(), false);
+        for (uint32_t node = 0; node < parents.size(); ++node) {
+            if (escaped[node]) {
+                regionEscaped[find(node)] = true;
+            }
+        }
+        for (std::size_t i = 0; i < sites.size(); ++i) {
+            sites[i]->threadLocal = !regionEscaped[find(siteNodes[i])];
+        }
+    }
+private:
+    std::vector<uint32_t> parents;
+    std::vector<bool> escaped;
+    std::vector<uint32_t> varNodes; // by variable id
+    std::vector<uint32_t> siteNodes;
+
+    uint32_t newNode() {
+        parents.push_back(parents.size());
+        escaped.push_back(false);
+        return parents.size() - 1;
+    }
+
+    uint32_t find(uint32_t node) {
+        while (parents[node] != node) {
+            parents[node] = parents[parents[node]];
+            node = parents[node];
+        }
+        return node;
+    }
+
+    void unite(uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if (a != b) {
+            parents[std::max(a, b)] = std::min(a, b);
+        }
+    }
+};
+
+/**
+ * Runs through the program (or a thread body) backwards, as the interpreter would run it forwards.
+ * Loops are not unrolled in the AST, only their counters are substituted into the names.
+ * After two iterations of a loop only the leaves using its counter are visited,
+ * so the work is proportional to the number of names rather than of the iterations.
+ * Variables get dense ids in the order of the pass,
+ * so the live set at any point is just the ids given so far, and the first sight of a name is its last use.
+ */
+class LivenessPass {
+public:
+    /**
+     * @param regions to feed with the references, if escapes are of interest.
+     * @param outerCounters of the loops around a thread body, the names are also kept relative to them.
+     * @param liveOut the variables used after the end of the program, if it's a window of a longer one.
+     */
+    LivenessPass(LeafCollector & collector, Regions * regions, ast::Repeat::Counters outerCounters = {}, LiveOut const * liveOut = nullptr)
+            : leaves(collector.leaves)
+            , steps(collector.steps)
+            , regions(regions)
+            , liveOut(liveOut)
+            , counters(std::move(outerCounters))
+            , outerLoops(counters.size()) {
+        runBackwards(collector.topLevel);
+    }
+
+    static std::size_t const NONE = SIZE_MAX;
+
+    struct LastUse {
+        std::size_t leaf;
+        std::size_t usedVar; // index in `Leaf::usedVars`, `NONE` if the variable lives up to a checkpoint
+        // `leaf` is `NONE` if the variable outlives the program
+    };
+
+    std::vector<std::string> names; // by id
+    std::vector<std::string> relativeNames; // by id, with the outer counters left unsubstituted, only if there are outer loops
+    std::vector<LastUse> lastUses; // by id
+    std::unordered_map<std::size_t, std::vector<ast::Repeat::Counters>> threadStarts; // counters of each start, by leaf
+private:
+    std::vector<Leaf> & leaves;
+    std::vector<Step> const & steps;
+    Regions * regions;
+    LiveOut const * liveOut;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<uint32_t> usedIds; // of the current leaf
+    ast::Repeat::Counters counters;
+    std::size_t outerLoops;
+    // of the loops past their last two iterations (the first two of the pass)
+    std::vector<std::string> settled;
+    std::size_t lastCheckpoint = NONE; // the leaf of the last checkpoint in the program
+
+    void runBackwards(std::vector<std::size_t> const & body) {
+        for (auto iter = body.rbegin(); iter != body.rend(); iter++) {
+            auto & step = steps[*iter];
+            if (step.loop == nullptr) {
+                if (changes(step.leaf)) {
+                    visitLeaf(step.leaf);
+                }
+                continue;
+            }
+            if (!changesAny(step.body)) {
+                continue;
+            }
+            counters.emplace_back(step.loop->counter, 0);
+            bool isSettled = false;
+            for (uint i = step.loop->times; i > 0; --i) {
+                if (i + 2 == step.loop->times) {
+                    // the leaves which don't use the counter have had their names seen, and used again
+                    settled.push_back(step.loop->counter);
+                    isSettled = true;
+                    if (!changesAny(step.body)) {
+                        break;
+                    }
+                }
+                counters.back().second = i - 1;
+                runBackwards(step.body);
+            }
+            if (isSettled) {
+                settled.pop_back();
+            }
+            counters.pop_back();
+        }
+    }
+
+    /**
+     * Whether visiting the leaf again can change anything.
+     * Thread starts are all recorded, other leaves give the same names as in the iterations seen already,
+     * unless they use the counters of all the settled loops.
+     */
+    bool changes(std::size_t leafId) const {
+        auto & leaf = leaves[leafId];
+        return leaf.thread != nullptr || mentionsAll(leaf.usedVars, settled);
+    }
+
+    bool changesAny(std::vector<std::size_t> const & body) const {
+        if (settled.empty()) {
+            return true;
+        }
+        return std::any_of(body.begin(), body.end(), [this](std::size_t stepId) {
+            auto & step = steps[stepId];
+            return step.loop == nullptr ? changes(step.leaf) : changesAny(step.body);
+        });
+    }
+
+    void visitLeaf(std::size_t leafId) {
+        auto & leaf = leaves[leafId];
+        leaf.executed = true;
+        if (leaf.isCheckpoint && lastCheckpoint == NONE) {
+            // a checkpoint saves every variable defined so far, so the variables used before it live up to it
+            lastCheckpoint = leafId;
+        }
+        if (leaf.thread != nullptr) {
+            threadStarts[leafId].push_back(counters);
+        }
+        std::string buf;
+        usedIds.clear();
+        for (std::size_t i = 0; i < leaf.usedVars.size(); ++i) {
+            auto & name = leaf.usedVars[i];
+            if (!counters.empty() && name.find('$') != std::string::npos) {
+                buf = ast::Repeat::expand(name, counters);
+            } else {
+                buf = name;
+            }
+            auto [iter, isLastUse] = ids.emplace(buf, (uint32_t) names.size());
+            usedIds.push_back(iter->second);
+            bool outlives = isLastUse && liveOut != nullptr && (*liveOut)(buf);
+            if (!isLastUse || lastCheckpoint != NONE || outlives) {
+                leaf.diesInEveryIteration[i] = false;
+            }
+            if (!isLastUse) {
+                continue;
+            }
+            if (outerLoops > 0) {
+                auto innerCounters = ast::Repeat::Counters(counters.begin() + (long) outerLoops, counters.end());
+                relativeNames.push_back(ast::Repeat::expand(name, innerCounters));
+            }
+            names.push_back(std::move(buf));
+            if (regions != nullptr) {
+                regions->addVar();
+                if (outlives) {
+                    regions->escape(iter->second);
+                }
+            }
+            if (outlives) {
+                lastUses.push_back({NONE, NONE});
+            } else if (lastCheckpoint != NONE) {
+                lastUses.push_back({lastCheckpoint, NONE});
+            } else {
+                lastUses.push_back({leafId, i});
+            }
+        }
+        if (regions != nullptr) {
+            regions->visit(leaf, usedIds);
+        }
+    }
+};
+
+/**
+ * Inserts the markers of the steps into the body, going into the loops as well.
+ */
+void placeMarkers(Body & body, std::vector<std::size_t> const & stepIds, std::vector<Step> const & steps) {
+    assert(body.size() == stepIds.size());
+    Body processedBody;
+    processedBody.reserve(body.size());
+    for (std::size_t i = 0; i < body.size(); ++i) {
+        auto & step = steps[stepIds[i]];
+        if (step.loop != nullptr) {
+            placeMarkers(step.loop->body, step.body, steps);
+        }
+        processedBody.push_back(std::move(body[i]));
+        for (auto & var : step.markersAfter) {
+            processedBody.push_back(std::make_unique<ast::EndOfLife>(var));
+        }
+    }
+    body = std::move(processedBody);
+}
+
+/**
+ * Places the markers of the leaves which use a variable for the last time in every iteration.
+ */
+void markDyingInEveryIteration(LeafCollector & collector) {
+    for (auto & leaf : collector.leaves) {
+        if (!leaf.executed) {
+            continue;
+        }
+        for (std::size_t i = 0; i < leaf.usedVars.size(); ++i) {
+            if (leaf.diesInEveryIteration[i]) {
+                collector.steps[leaf.step].markersAfter.push_back(leaf.usedVars[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Places `EndOfLife` markers into a thread body, so the thread releases the globals it captured right after their last use.
+ * All the threads started by the statement share the body, so a marker is placed only if it suits every one of them.
+ * Other variables are released when the thread finishes.
+ * @param starts the counters of the enclosing loops for each start of the thread.
+ */
+void markEndsOfLifeInThread(ast::NewThread & newThread, std::vector<ast::Repeat::Counters> const & starts) {
+    auto collector = LeafCollector(*newThread.body);
+    std::vector<std::vector<LivenessPass::LastUse>> lastUses;
+    std::vector<std::vector<std::string>> names;
+    for (auto & counters : starts) {
+        auto liveness = LivenessPass(collector, nullptr, counters);
+        lastUses.push_back(std::move(liveness.lastUses));
+        names.push_back(counters.empty() ? std::move(liveness.names) : std::move(liveness.relativeNames));
+    }
+    // whether a leaf kills a variable in every iteration is known only after all the starts are seen,
+    // the rest need markers after the top-level statements of the body, wanted by every start
+    std::optional<std::set<std::pair<std::size_t, std::string>>> common;
+    for (std::size_t start = 0; start < starts.size(); ++start) {
+        std::set<std::pair<std::size_t, std::string>> markers;
+        for (std::size_t id = 0; id < lastUses[start].size(); ++id) {
+            auto & lastUse = lastUses[start][id];
+            auto & leaf = collector.leaves[lastUse.leaf];
+            if (!leaf.diesInEveryIteration[lastUse.usedVar]) {
+                markers.emplace(leaf.topLevelStep, names[start][id]);
+            }
+        }
+        if (!common.has_value()) {
+            common = std::move(markers);
+        } else {
+            std::set<std::pair<std::size_t, std::string>> intersection;
+            std::set_intersection(common->begin(), common->end(), markers.begin(), markers.end(),
+                                  std::inserter(intersection, intersection.begin()));
+            common = std::move(intersection);
+        }
+    }
+
+    markDyingInEveryIteration(collector);
+    for (auto & [step, var] : *common) {
+        collector.steps[step].markersAfter.push_back(var);
+    }
+    placeMarkers(*newThread.body, collector.topLevel, collector.steps);
+}
+
+/**
+ * Places an `EndOfLife` marker after the last use of each variable.
+ * If a statement in a loop uses a variable for the last time in every iteration (like `tmp_$i = object`),
+ * the marker is placed right after the statement in the loop body.
+ * Otherwise, the marker goes after the whole top-level loop.
+ * Allocation sites are marked thread-local on the way.
+ * @param liveOut the variables which must survive the program, if it's a window of a longer one.
+ * @return all the variables used in the program.
+ */
+std::unordered_set<std::string> markEndsOfLife(Body & prog, LiveOut const * liveOut = nullptr) {
+    auto collector = LeafCollector(prog);
+    auto regions = Regions(collector.sites.size());
+    auto liveness = LivenessPass(collector, &regions, {}, liveOut);
+    regions.markSites(collector.sites);
+
+    auto & steps = collector.steps;
+    markDyingInEveryIteration(collector);
+    for (std::size_t id = 0; id < liveness.names.size(); ++id) {
+        auto & lastUse = liveness.lastUses[id];
+        if (lastUse.leaf == LivenessPass::NONE) {
+            continue;
+        }
+        auto & leaf = collector.leaves[lastUse.leaf];
+        if (lastUse.usedVar == LivenessPass::NONE || !leaf.diesInEveryIteration[lastUse.usedVar]) {
+            steps[leaf.topLevelStep].markersAfter.push_back(liveness.names[id]);
+        }
+    }
+
+    for (auto & [leafId, starts] : liveness.threadStarts) {
+        markEndsOfLifeInThread(*collector.leaves[leafId].thread, starts);
+    }
+
+    placeMarkers(prog, collector.topLevel, steps);
+    return {std::make_move_iterator(liveness.names.begin()), std::make_move_iterator(liveness.names.end())};
+}
+
+/**
+ * A set of names, where a name with a loop counter placeholder stands for all the names it can expand to.
+ */
+class NamePatterns {
+public:
+    void insert(std::string const & name) {
+        auto placeholder = name.find('$');
+        if (placeholder == std::string::npos) {
+            exact.insert(name);
+        } else {
+            // the part before the first placeholder is kept by any expansion
+            prefixes.insert(name.substr(0, placeholder));
+        }
+    }
+
+    void insertAll(NamePatterns const & that) {
+        exact.insert(that.exact.begin(), that.exact.end());
+        prefixes.insert(that.prefixes.begin(), that.prefixes.end());
+    }
+
+    /**
+     * Removes the names the set may contain from `names`.
+     */
+    void eraseFrom(std::unordered_set<std::string> & names) const {
+        for (auto & name : exact) {
+            names.erase(name);
+        }
+        if (prefixes.empty()) {
+            return;
+        }
+        for (auto iter = names.begin(); iter != names.end();) {
+            iter = mayContain(*iter) ? names.erase(iter) : std::next(iter);
+        }
+    }
+
+    /**
+     * Whether the set may contain a name the given one, possibly with placeholders, can expand to.
+     */
+    [[nodiscard]] bool mayOverlap(std::string const & name) const {
+        auto placeholder = name.find('$');
+        if (placeholder == std::string::npos) {
+            return mayContain(name);
+        }
+        auto prefix = name.substr(0, placeholder);
+        auto startsWith = [](std::string const & str, std::string const & start) {
+            return str.compare(0, start.length(), start) == 0;
+        };
+        return std::any_of(exact.begin(), exact.end(), [&](std::string const & name) { return startsWith(name, prefix); })
+                || std::any_of(prefixes.begin(), prefixes.end(), [&](std::string const & other) {
+                    return startsWith(other, prefix) || startsWith(prefix, other);
+                });
+    }
+
+    [[nodiscard]] bool mayContain(std::string const & name) const {
+        if (exact.count(name) != 0) {
+            return true;
+        }
+        return std::any_of(prefixes.begin(), prefixes.end(), [&name](std::string const & prefix) {
+            return name.compare(0, prefix.length(), prefix) == 0;
+        });
+    }
+private:
+    std::unordered_set<std::string> exact;
+    std::set<std::string> prefixes;
+};
+
+/**
+ * Finds what statements read and write, without substituting loop counters.
+ */
+class AccessFinder : public ast::Statement::Visitor, public ast::Expression::Visitor {
+public:
+    NamePatterns vars; // read or written
+    NamePatterns threadVars; // captured by threads
+    NamePatterns readFields;
+    std::unordered_map<std::string, uint> fieldStores; // by field name, placeholders included
+    bool hasDump = false;
+    bool hasCheckpoint = false;
+private:
+    bool inThread = false;
+
+    void visitAssign(ast::Assign & assign) override {
+        if (auto field = dynamic_cast<ast::SelectField *>(assign.to.get())) {
+            // only the containing object is read
+            field->obj->accept(*this);
+            fieldStores[field->name] += 1;
+        } else {
+            assign.to->accept(*this);
+        }
+        assign.from->accept(*this);
+    }
+
+    void visitNewThread(ast::NewThread & newThread) override {
+        inThread = true;
+        for (auto & stat : *newThread.body) {
             stat->accept(*this);
         }
+        inThread = false;
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitJoin(ast::Join & join) override {}
+
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override {
+        hasCheckpoint = true;
     }
 
     void visitSleep(ast::Sleep & sleep) override {}
 
     void visitSleepr(ast::Sleepr & sleepr) override {}
 
+    void visitStats(ast::Stats & stats) override {}
+
+    void visitFreeze(ast::Freeze & freeze) override {
+        freeze.expr->accept(*this);
+    }
+
     void visitDump(ast::Dump & dump) override {
+        hasDump = true;
         dump.expr->accept(*this);
     }
 
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {}
+
     void visitNewObject(ast::NewObject & newObject) override {}
 
     void visitVar(ast::Var & var) override {
-        usedVars.insert(var.name);
+        vars.insert(var.name);
+        if (inThread) {
+            threadVars.insert(var.name);
+        }
     }
 
     void visitSelectField(ast::SelectField & selectField) override {
+        readFields.insert(selectField.name);
         selectField.obj->accept(*this);
     }
 };
 
-class VarsUsedInThreadCollector : public ast::Statement::Visitor {
+/**
+ * A top-level `var = object` or `var.field = object`.
+ */
+struct Allocation {
+    std::string var; // the assigned one, or the one containing the field
+    std::string field; // empty for a variable
+};
+
+std::optional<Allocation> asAllocation(ast::Statement & stat) {
+    auto assign = dynamic_cast<ast::Assign *>(&stat);
+    if (assign == nullptr || assign->isWeak || dynamic_cast<ast::NewObject *>(assign->from.get()) == nullptr) {
+        return std::nullopt;
+    }
+    if (auto var = dynamic_cast<ast::Var *>(assign->to.get())) {
+        return Allocation{var->name, ""};
+    }
+    auto field = dynamic_cast<ast::SelectField *>(assign->to.get());
+    auto containing = field == nullptr ? nullptr : dynamic_cast<ast::Var *>(field->obj.get());
+    if (containing == nullptr) {
+        return std::nullopt;
+    }
+    return Allocation{containing->name, field->name};
+}
+
+bool isBarrier(ast::Statement & stat) {
+    return dynamic_cast<ast::Assign *>(&stat) == nullptr && dynamic_cast<ast::Dump *>(&stat) == nullptr;
+}
+
+/**
+ * A single round of `removeDeadStores`.
+ */
+std::size_t removeDeadStoresOnce(Body & prog) {
+    AccessFinder program;
+    for (auto & stat : prog) {
+        stat->accept(program);
+    }
+    bool fieldsAreHidden = !program.hasDump && !program.hasCheckpoint;
+
+    // forward: which allocations store into a fresh variable, or into an object surely held by a strong reference
+    std::vector<bool> fresh(prog.size(), false);
+    std::vector<bool> strongContaining(prog.size(), false);
+    NamePatterns mayBeDefined;
+    std::unordered_set<std::string> surelyStrong;
+    for (std::size_t i = 0; i < prog.size(); ++i) {
+        auto & stat = *prog[i];
+        if (auto allocation = asAllocation(stat)) {
+            fresh[i] = allocation->field.empty() && !mayBeDefined.mayContain(allocation->var);
+            strongContaining[i] = !allocation->field.empty() && surelyStrong.count(allocation->var) != 0;
+        }
+        AccessFinder access;
+        stat.accept(access);
+        mayBeDefined.insertAll(access.vars);
+
+        auto assign = dynamic_cast<ast::Assign *>(&stat);
+        auto var = assign == nullptr ? nullptr : dynamic_cast<ast::Var *>(assign->to.get());
+        if (var != nullptr && !assign->isWeak && !program.threadVars.mayContain(var->name)) {
+            surelyStrong.insert(var->name);
+        } else if (var != nullptr) {
+            surelyStrong.erase(var->name);
+        } else if (isBarrier(stat)) {
+            // loops and threads may redefine anything they mention
+            access.vars.eraseFrom(surelyStrong);
+        }
+    }
+
+    NamePatterns storedFields;
+    for (auto & [field, stores] : program.fieldStores) {
+        if (field.find('$') != std::string::npos) {
+            storedFields.insert(field);
+        }
+    }
+    auto isStoredOnce = [&](std::string const & field) {
+        return program.fieldStores[field] == 1 && !storedFields.mayContain(field);
+    };
+
+    // backward: which variables may be read before being overwritten
+    std::size_t removed = 0;
+    NamePatterns mayBeRead;
+    std::unordered_set<std::string> overwrittenNext;
+    bool everythingRead = false; // by a checkpoint
+    for (std::size_t i = prog.size(); i > 0; --i) {
+        auto & stat = *prog[i - 1];
+        auto allocation = asAllocation(stat);
+        bool dead = false;
+        if (allocation && !program.threadVars.mayContain(allocation->var)) {
+            if (allocation->field.empty()) {
+                bool unread = !everythingRead && !mayBeRead.mayContain(allocation->var);
+                dead = fresh[i - 1] && (unread || overwrittenNext.count(allocation->var) != 0);
+            } else {
+                dead = fieldsAreHidden
+                        && strongContaining[i - 1]
+                        && !program.readFields.mayContain(allocation->field)
+                        && isStoredOnce(allocation->field);
+            }
+        }
+        if (dead) {
+            prog.erase(prog.begin() + static_cast<std::ptrdiff_t>(i - 1));
+            removed += 1;
+            continue;
+        }
+
+        auto assign = dynamic_cast<ast::Assign *>(&stat);
+        auto var = assign == nullptr ? nullptr : dynamic_cast<ast::Var *>(assign->to.get());
+        AccessFinder reads;
+        if (var != nullptr) {
+            assign->from->accept(reads);
+            overwrittenNext.insert(var->name);
+        } else {
+            stat.accept(reads);
+        }
+        if (isBarrier(stat)) {
+            overwrittenNext.clear();
+        }
+        reads.vars.eraseFrom(overwrittenNext);
+        if (dynamic_cast<ast::Checkpoint *>(&stat) != nullptr) {
+            everythingRead = true;
+        }
+        mayBeRead.insertAll(reads.vars);
+    }
+    return removed;
+}
+
+std::size_t removeDeadStores(Body & prog) {
+    std::size_t removed = 0;
+    // a removed statement may be the only reason to keep another one
+    while (auto removedNow = removeDeadStoresOnce(prog)) {
+        removed += removedNow;
+    }
+    return removed;
+}
+
+/**
+ * Whether a statement touches nothing but variables, so it can run on a worker thread.
+ */
+bool isMovable(ast::Statement & stat) {
+    if (dynamic_cast<ast::Assign *>(&stat) != nullptr || dynamic_cast<ast::EndOfLife *>(&stat) != nullptr) {
+        return true;
+    }
+    auto loop = dynamic_cast<ast::Repeat *>(&stat);
+    return loop != nullptr && std::all_of(loop->body.begin(), loop->body.end(), [](auto & inner) {
+        return isMovable(*inner);
+    });
+}
+
+/**
+ * The variables and fields weak references are stored in, placeholders included.
+ */
+class WeakTargetFinder : public ast::Statement::Visitor {
 public:
-    explicit VarsUsedInThreadCollector(std::unordered_set<std::string> & usedVars) : usedVars(usedVars) {}
+    explicit WeakTargetFinder(WeakTargets & targets) : targets(targets) {}
+private:
+    WeakTargets & targets;
+
+    void visitAssign(ast::Assign & assign) override {
+        if (!assign.isWeak) {
+            return;
+        }
+        if (auto var = dynamic_cast<ast::Var *>(assign.to.get())) {
+            targets.vars.insert(var->name);
+        } else if (auto field = dynamic_cast<ast::SelectField *>(assign.to.get())) {
+            targets.fields.insert(field->name);
+        }
+    }
 
     void visitNewThread(ast::NewThread & newThread) override {
-        newThread.usedVars = usedVars;
+        for (auto & stat : *newThread.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitStatement(ast::Statement & stat) override {}
+};
+
+/**
+ * Whether a statement creates, reads or drops weak references.
+ * A weak reference doesn't keep its object alive, so it can't be told apart from the variables owning the object by names,
+ * and it's never moved to a worker thread.
+ */
+class WeakRefFinder : public ast::Statement::Visitor, public ast::Expression::Visitor {
+public:
+    explicit WeakRefFinder(WeakTargets const & targets) {
+        for (auto & var : targets.vars) {
+            vars.insert(var);
+        }
+        for (auto & field : targets.fields) {
+            fields.insert(field);
+        }
+    }
+
+    bool touches(ast::Statement & stat) {
+        found = false;
+        stat.accept(*this);
+        return found;
+    }
+private:
+    NamePatterns vars;
+    NamePatterns fields;
+    bool found = false;
+
+    void visitAssign(ast::Assign & assign) override {
+        found = found || assign.isWeak;
+        assign.to->accept(*this);
+        assign.from->accept(*this);
     }
 
+    void visitRepeat(ast::Repeat & repeat) override {
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {
+        found = found || vars.mayOverlap(endOfLife.varName);
+    }
+
+    // the other statements are never movable anyway
     void visitStatement(ast::Statement & stat) override {}
 
+    void visitNewObject(ast::NewObject & newObject) override {}
+
+    void visitVar(ast::Var & var) override {
+        found = found || vars.mayOverlap(var.name);
+    }
+
+    void visitSelectField(ast::SelectField & selectField) override {
+        found = found || fields.mayOverlap(selectField.name);
+        selectField.obj->accept(*this);
+    }
+};
+
+/**
+ * The names a movable statement uses, sorted by how they change between the iterations of a top-level loop.
+ */
+struct NameUse {
+    std::unordered_set<std::string> fixed; // the same in every iteration
+    std::set<std::string> keyed; // `prefix$counter...`, the iteration is the number right after the prefix
+    std::set<std::string> wild; // prefixes of the names which can't be told apart by the iteration
+};
+
+/**
+ * Finds the variables a movable statement touches, and how many statements it executes, without unrolling the loops.
+ */
+class WorkFinder : public ast::Statement::Visitor, public ast::Expression::Visitor {
+public:
+    /**
+     * @param counter of the top-level loop the statement is the body of, empty if there is none.
+     */
+    explicit WorkFinder(std::string counter) : counter(std::move(counter)) {}
+
+    NameUse vars;
+    NameUse writtenVars;
+    std::size_t work = 0;
+    // fields are reachable through any alias of their object, so they can't be told apart by names
+    bool touchesFields = false;
+    bool storesFields = false;
 private:
-    std::unordered_set<std::string> & usedVars;
+    std::string counter;
+    std::vector<std::string> innerCounters;
+
+    void add(NameUse & use, std::string const & name) const {
+        auto placeholder = name.find('$');
+        if (placeholder == std::string::npos) {
+            use.fixed.insert(name);
+            return;
+        }
+        auto prefix = name.substr(0, placeholder);
+        auto rest = placeholder + 1 + counter.length();
+        auto shadowed = std::any_of(innerCounters.begin(), innerCounters.end(), [&](std::string const & inner) {
+            return name.compare(placeholder + 1, inner.length(), inner) == 0;
+        });
+        // the number is told from the rest of the name only if there are no digits around it
+        bool isKeyed = !counter.empty() && !shadowed && name.compare(placeholder + 1, counter.length(), counter) == 0
+                && (prefix.empty() || !std::isdigit(prefix.back()))
+                && (rest == name.length() || (!std::isdigit(name[rest]) && name[rest] != '$'));
+        if (isKeyed) {
+            use.keyed.insert(prefix);
+        } else {
+            use.wild.insert(prefix);
+        }
+    }
+
+    void visitAssign(ast::Assign & assign) override {
+        work += 1;
+        if (auto var = dynamic_cast<ast::Var *>(assign.to.get())) {
+            add(writtenVars, var->name);
+        } else {
+            storesFields = true;
+        }
+        assign.to->accept(*this);
+        assign.from->accept(*this);
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        auto outerWork = work;
+        work = 0;
+        innerCounters.push_back(repeat.counter);
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+        innerCounters.pop_back();
+        work = outerWork + saturatingMul(work, repeat.times);
+    }
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {
+        work += 1;
+        add(vars, endOfLife.varName);
+        add(writtenVars, endOfLife.varName);
+    }
+
+    void visitNewObject(ast::NewObject & newObject) override {}
+
+    void visitVar(ast::Var & var) override {
+        add(vars, var.name);
+    }
+
+    void visitSelectField(ast::SelectField & selectField) override {
+        touchesFields = true;
+        selectField.obj->accept(*this);
+    }
+
+    static std::size_t saturatingMul(std::size_t a, std::size_t b) {
+        return b != 0 && a > SIZE_MAX / b ? SIZE_MAX : a * b;
+    }
 };
 
-std::unordered_set<std::string> preprocess(std::vector<std::unique_ptr<ast::Statement>> & prog) {
-    std::forward_list<std::unique_ptr<ast::Statement>> processedProg;
-    std::unordered_set<std::string> aliveAndUndeclaredVars;
-    for (auto iter = prog.rbegin(); iter != prog.rend(); iter++) {
-        auto & stat = *iter;
-        auto usageFinder = UsageFinder();
-        stat->accept(usageFinder);
-        auto threadPatcher = VarsUsedInThreadCollector(usageFinder.usedVars);
-        stat->accept(threadPatcher);
-        for (auto const & usedVar: usageFinder.usedVars) {
-            if (aliveAndUndeclaredVars.count(usedVar) == 0) {
-                processedProg.push_front(std::make_unique<ast::EndOfLife>(usedVar));
-                aliveAndUndeclaredVars.insert(usedVar);
+/**
+ * Groups of statements smaller than this run faster sequentially than on a thread of their own.
+ */
+std::size_t const MIN_PARALLEL_WORK = 1000;
+
+/**
+ * Top-level loops are split into chunks of iterations, this many per worker at most, to balance the groups.
+ */
+std::size_t const CHUNKS_PER_WORKER = 4;
+
+/**
+ * Splits a run of movable statements into groups touching disjoint sets of variables.
+ * Iterations of a top-level loop are split as well, in chunks of the same size in every loop,
+ * so the names numbered by the counter conflict only within the chunks of the same number.
+ * @return `nullptr` if there is not enough independent work.
+ */
+std::unique_ptr<ast::Parallel> groupIndependent(Body & run, uint workers) {
+    // an execution of a non-loop statement, or a chunk of iterations of a loop
+    struct Unit {
+        std::size_t stat;
+        uint begin;
+        uint end;
+        std::size_t work;
+    };
+    uint maxTimes = 1;
+    for (auto & stat : run) {
+        if (auto loop = dynamic_cast<ast::Repeat *>(stat.get())) {
+            maxTimes = std::max(maxTimes, loop->times);
+        }
+    }
+    auto maxChunks = workers * CHUNKS_PER_WORKER;
+    auto chunk = static_cast<uint>((maxTimes + maxChunks - 1) / maxChunks);
+
+    std::vector<Unit> units;
+    std::vector<WorkFinder> finders;
+    std::vector<uint32_t> firstUnit; // by statement, the units of a statement are consecutive
+    for (std::size_t i = 0; i < run.size(); ++i) {
+        firstUnit.push_back(units.size());
+        auto loop = dynamic_cast<ast::Repeat *>(run[i].get());
+        if (loop == nullptr) {
+            finders.emplace_back("");
+            run[i]->accept(finders.back());
+            units.push_back({i, 0, 1, finders.back().work});
+            continue;
+        }
+        finders.emplace_back(loop->counter);
+        for (auto & stat : loop->body) {
+            stat->accept(finders.back());
+        }
+        auto work = finders.back().work;
+        for (uint begin = 0; begin < loop->times; begin += std::min(chunk, loop->times - begin)) {
+            auto end = begin + std::min(chunk, loop->times - begin);
+            units.push_back({i, begin, end, work > SIZE_MAX / (end - begin) ? SIZE_MAX : work * (end - begin)});
+        }
+    }
+    firstUnit.push_back(units.size());
+
+    std::vector<uint32_t> parents(units.size());
+    std::iota(parents.begin(), parents.end(), 0);
+    auto find = [&parents](uint32_t unit) {
+        while (parents[unit] != unit) {
+            parents[unit] = parents[parents[unit]];
+            unit = parents[unit];
+        }
+        return unit;
+    };
+    auto unite = [&](uint32_t a, uint32_t b) {
+        parents[find(a)] = find(b);
+    };
+    // every unit of the statement, and of the other one, if any; only the statements with units are passed
+    auto uniteAll = [&](std::size_t stat, std::optional<std::size_t> other) {
+        for (auto unit = firstUnit[stat]; unit < firstUnit[stat + 1]; ++unit) {
+            unite(unit, firstUnit[stat]);
+        }
+        if (other) {
+            for (auto unit = firstUnit[*other]; unit < firstUnit[*other + 1]; ++unit) {
+                unite(unit, firstUnit[stat]);
+            }
+        }
+    };
+
+    // units conflict if one of them writes a variable the other one uses, reading the same object concurrently is fine
+    struct Pattern {
+        std::size_t stat;
+        std::string prefix;
+        bool isKeyed;
+        bool isWritten;
+    };
+    std::unordered_map<std::string, std::vector<std::size_t>> fixedUsers;
+    std::unordered_set<std::string> fixedWritten;
+    std::vector<Pattern> patterns;
+    bool fieldsStored = false;
+    for (std::size_t i = 0; i < run.size(); ++i) {
+        auto & finder = finders[i];
+        if (firstUnit[i] == firstUnit[i + 1]) {
+            continue; // a loop with no iterations
+        }
+        for (auto & var : finder.vars.fixed) {
+            fixedUsers[var].push_back(i);
+        }
+        fixedWritten.insert(finder.writtenVars.fixed.begin(), finder.writtenVars.fixed.end());
+        for (auto & prefix : finder.vars.keyed) {
+            patterns.push_back({i, prefix, true, finder.writtenVars.keyed.count(prefix) != 0});
+        }
+        for (auto & prefix : finder.vars.wild) {
+            patterns.push_back({i, prefix, false, finder.writtenVars.wild.count(prefix) != 0});
+        }
+        fieldsStored |= finder.storesFields;
+    }
+
+    // the same fixed name in every unit of its users
+    for (auto & [var, users] : fixedUsers) {
+        if (fixedWritten.count(var) != 0) {
+            for (auto user : users) {
+                uniteAll(user, users.front());
+            }
+        }
+    }
+    for (auto & pattern : patterns) {
+        auto & [stat, prefix, isKeyed, isWritten] = pattern;
+        if (!isKeyed && isWritten) {
+            uniteAll(stat, std::nullopt);
+        }
+        for (auto & [var, users] : fixedUsers) {
+            if (var.compare(0, prefix.length(), prefix) != 0 || (!isWritten && fixedWritten.count(var) == 0)) {
+                continue;
+            }
+            std::optional<std::size_t> iteration;
+            auto digits = var.find_first_not_of("0123456789", prefix.length());
+            auto number = var.substr(prefix.length(), digits == std::string::npos ? std::string::npos : digits - prefix.length());
+            if (isKeyed && number.empty()) {
+                continue;
             }
+            if (isKeyed && number.length() <= 9) {
+                iteration = std::stoul(number);
+            }
+            for (auto user : users) {
+                uniteAll(user, std::nullopt);
+                if (!isKeyed || !iteration) {
+                    uniteAll(stat, user);
+                    continue;
+                }
+                for (auto unit = firstUnit[stat]; unit < firstUnit[stat + 1]; ++unit) {
+                    if (units[unit].begin <= *iteration && *iteration < units[unit].end) {
+                        unite(unit, firstUnit[user]);
+                    }
+                }
+            }
+        }
+    }
+    for (std::size_t i = 0; i < patterns.size(); ++i) {
+        for (std::size_t j = i + 1; j < patterns.size(); ++j) {
+            auto & first = patterns[i];
+            auto & second = patterns[j];
+            if (!first.isWritten && !second.isWritten) {
+                continue;
+            }
+            auto & shorter = first.prefix.length() <= second.prefix.length() ? first : second;
+            auto & longer = &shorter == &first ? second : first;
+            if (longer.prefix.compare(0, shorter.prefix.length(), shorter.prefix) != 0) {
+                continue;
+            }
+            if (first.isKeyed && second.isKeyed && first.prefix == second.prefix) {
+                // the same number in both, so the same iteration
+                auto firstUnits = firstUnit[first.stat + 1] - firstUnit[first.stat];
+                auto secondUnits = firstUnit[second.stat + 1] - firstUnit[second.stat];
+                for (uint32_t k = 0; k < std::min(firstUnits, secondUnits); ++k) {
+                    unite(firstUnit[first.stat] + k, firstUnit[second.stat] + k);
+                }
+                continue;
+            }
+            if (shorter.isKeyed && longer.prefix.length() > shorter.prefix.length() && !std::isdigit(longer.prefix[shorter.prefix.length()])) {
+                // where the shorter one has a number, the longer one has something else
+                continue;
+            }
+            uniteAll(first.stat, second.stat);
+        }
+    }
+    if (fieldsStored) {
+        std::optional<std::size_t> firstFieldUser;
+        for (std::size_t i = 0; i < run.size(); ++i) {
+            if (finders[i].touchesFields && firstUnit[i] < firstUnit[i + 1]) {
+                uniteAll(i, firstFieldUser);
+                firstFieldUser = firstFieldUser.value_or(i);
+            }
+        }
+    }
+    finders.clear();
+
+    std::unordered_map<uint32_t, std::size_t> componentWork;
+    for (uint32_t unit = 0; unit < units.size(); ++unit) {
+        auto & work = componentWork[find(unit)];
+        work = std::min(work, SIZE_MAX - units[unit].work) + units[unit].work;
+    }
+    // the heaviest components first, each to the least loaded group
+    std::vector<std::pair<std::size_t, uint32_t>> components;
+    for (auto & [root, work] : componentWork) {
+        components.emplace_back(work, root);
+    }
+    std::sort(components.rbegin(), components.rend());
+    auto groupCount = std::min<std::size_t>(workers, components.size());
+    std::vector<std::size_t> groupWork(groupCount, 0);
+    std::unordered_map<uint32_t, std::size_t> groupOf;
+    for (auto & [work, root] : components) {
+        auto group = std::min_element(groupWork.begin(), groupWork.end()) - groupWork.begin();
+        groupWork[group] = std::min(groupWork[group], SIZE_MAX - work) + work;
+        groupOf[root] = group;
+    }
+    auto bigGroups = std::count_if(groupWork.begin(), groupWork.end(), [](std::size_t work) {
+        return work >= MIN_PARALLEL_WORK;
+    });
+    if (bigGroups < 2) {
+        return nullptr;
+    }
+
+    std::vector<std::vector<ast::Parallel::Part>> groups(groupCount);
+    for (uint32_t unit = 0; unit < units.size(); ++unit) {
+        auto & parts = groups[groupOf[find(unit)]];
+        auto & [stat, begin, end, work] = units[unit];
+        bool isLoop = dynamic_cast<ast::Repeat *>(run[stat].get()) != nullptr;
+        if (isLoop && !parts.empty() && parts.back().stat == stat && parts.back().end == begin) {
+            parts.back().end = end;
+        } else {
+            parts.push_back({stat, begin, end});
+        }
+    }
+    UsageFinder usage;
+    for (auto & stat : run) {
+        stat->accept(usage);
+    }
+    return std::make_unique<ast::Parallel>(std::move(run), std::move(groups), std::move(usage.usedVars));
+}
+
+std::size_t parallelize(Body & prog, uint workers, WeakTargets const & weakTargets) {
+    if (workers < 2) {
+        return 0;
+    }
+    WeakRefFinder weakRefs(weakTargets);
+    std::size_t created = 0;
+    Body result;
+    Body run;
+    auto flush = [&]() {
+        auto parallel = groupIndependent(run, workers);
+        if (parallel != nullptr) {
+            result.push_back(std::move(parallel));
+            created += 1;
+        } else {
+            std::move(run.begin(), run.end(), std::back_inserter(result));
+        }
+        run.clear();
+    };
+    for (auto & stat : prog) {
+        if (isMovable(*stat) && !weakRefs.touches(*stat)) {
+            run.push_back(std::move(stat));
+            continue;
+        }
+        flush();
+        result.push_back(std::move(stat));
+    }
+    flush();
+    prog = std::move(result);
+    return created;
+}
+
+void findWeakTargets(Body & prog, WeakTargets & targets) {
+    WeakTargetFinder finder(targets);
+    for (auto & stat : prog) {
+        stat->accept(finder);
+    }
+}
+
+std::size_t parallelize(Body & prog, uint workers) {
+    WeakTargets weakTargets;
+    findWeakTargets(prog, weakTargets);
+    return parallelize(prog, workers, weakTargets);
+}
+
+/**
+ * Finds the threads started by the top-level statements, including the ones in loops.
+ */
+class ThreadFinder : public ast::Statement::Visitor {
+public:
+    std::vector<ast::NewThread *> threads;
+private:
+    void visitAssign(ast::Assign & assign) override {}
+
+    void visitNewThread(ast::NewThread & newThread) override {
+        threads.push_back(&newThread);
+    }
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        for (auto & stat : repeat.body) {
+            stat->accept(*this);
+        }
+    }
+
+    void visitJoin(ast::Join & join) override {}
+
+    void visitCheckpoint(ast::Checkpoint & checkpoint) override {}
+
+    void visitSleep(ast::Sleep & sleep) override {}
+
+    void visitSleepr(ast::Sleepr & sleepr) override {}
+
+    void visitStats(ast::Stats & stats) override {}
+
+    void visitFreeze(ast::Freeze & freeze) override {}
+
+    void visitDump(ast::Dump & dump) override {}
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {}
+
+    // parallel blocks never start threads
+    void visitParallel(ast::Parallel & parallel) override {}
+};
+
+/**
+ * Everything the interpreter takes from a prepared thread body besides the captured variables, as a string:
+ * the statements along with the allocation sites found thread-local.
+ */
+class BodyKey : public ast::Statement::Visitor, public ast::Expression::Visitor {
+public:
+    explicit BodyKey(ast::NewThread & newThread) {
+        statements(*newThread.body);
+    }
+
+    [[nodiscard]] std::string str() const {
+        return key.str();
+    }
+private:
+    std::stringstream key;
+
+    void statements(Body & body) {
+        for (auto & stat : body) {
+            stat->accept(*this);
+            key << std::endl;
         }
-        processedProg.push_front(std::move(stat));
     }
-    prog.clear();
-    for (auto & stat: processedProg) {
-        prog.push_back(std::move(stat));
+
+    void visitAssign(ast::Assign & assign) override {
+        assign.print(key);
+        assign.from->accept(*this);
     }
-    return aliveAndUndeclaredVars;
+
+    void visitRepeat(ast::Repeat & repeat) override {
+        key << "repeat " << repeat.times << " " << repeat.counter << " {" << std::endl;
+        statements(repeat.body);
+        key << "}";
+    }
+
+    void visitSleep(ast::Sleep & sleep) override {
+        sleep.print(key);
+    }
+
+    void visitSleepr(ast::Sleepr & sleepr) override {
+        sleepr.print(key);
+    }
+
+    void visitStats(ast::Stats & stats) override {
+        stats.print(key);
+    }
+
+    void visitFreeze(ast::Freeze & freeze) override {
+        freeze.print(key);
+        freeze.expr->accept(*this);
+    }
+
+    void visitDump(ast::Dump & dump) override {
+        dump.print(key);
+        dump.expr->accept(*this);
+    }
+
+    void visitEndOfLife(ast::EndOfLife & endOfLife) override {
+        endOfLife.print(key);
+    }
+
+    void visitNewObject(ast::NewObject & newObject) override {
+        key << (newObject.threadLocal ? " #local" : " #shared");
+    }
+
+    void visitVar(ast::Var & var) override {}
+
+    void visitSelectField(ast::SelectField & selectField) override {}
+};
+
+std::size_t shareThreadBodies(Body & prog) {
+    ThreadFinder finder;
+    for (auto & stat : prog) {
+        stat->accept(finder);
+    }
+    // capture sets are cheaper to compare, so only the bodies of the threads capturing the same variables are
+    std::map<std::set<std::string>, std::vector<ast::NewThread *>> byCaptured;
+    for (auto thread : finder.threads) {
+        byCaptured[std::set<std::string>(thread->usedVars->begin(), thread->usedVars->end())].push_back(thread);
+    }
+    std::size_t freed = 0;
+    for (auto & [captured, threads] : byCaptured) {
+        if (threads.size() < 2) {
+            continue;
+        }
+        std::unordered_map<std::string, ast::NewThread *> firsts;
+        for (auto thread : threads) {
+            auto [first, added] = firsts.emplace(BodyKey(*thread).str(), thread);
+            if (!added) {
+                thread->body = first->second->body;
+                thread->usedVars = first->second->usedVars;
+                freed += 1;
+            }
+        }
+    }
+    return freed;
+}
+
+std::unordered_set<std::string> preprocessWindow(std::vector<std::unique_ptr<ast::Statement>> & window, LiveOut const & liveOut,
+                                                 WeakTargets & weakTargets, uint workers) {
+    auto names = markEndsOfLife(window, &liveOut);
+    findWeakTargets(window, weakTargets);
+    auto & stats = PreparationStats::total();
+    stats.parallelBlocks += parallelize(window, workers, weakTargets);
+    stats.sharedBodies += shareThreadBodies(window);
+    return names;
+}
+
+std::unordered_set<std::string> preprocess(std::vector<std::unique_ptr<ast::Statement>> & prog, uint workers) {
+    auto removed = removeDeadStores(prog);
+    log("Removed " + std::to_string(removed) + " dead statements");
+    auto names = markEndsOfLife(prog);
+    auto parallel = parallelize(prog, workers);
+    log("Grouped independent statements into " + std::to_string(parallel) + " parallel blocks");
+    auto shared = shareThreadBodies(prog);
+    log("Shared " + std::to_string(shared) + " identical thread bodies");
+    auto & stats = PreparationStats::total();
+    stats.deadStatements += removed;
+    stats.parallelBlocks += parallel;
+    stats.sharedBodies += shared;
+    return names;
+}
+
+PreparationStats & PreparationStats::total() {
+    static PreparationStats stats;
+    return stats;
+}
+
+void PreparationStats::print(std::ostream & out) const {
+    out << "removed " << deadStatements << " dead statements, grouped " << parallelBlocks
+        << " parallel blocks, shared " << sharedBodies << " thread bodies";
 }
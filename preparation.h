@@ -1,7 +1,81 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <list>
+#include <ostream>
+#include <thread>
 
 #include "ast.h"
 
-std::unordered_set<std::string> preprocess(std::vector<std::unique_ptr<ast::Statement>> & prog);
+/**
+ * The version of what the preparation makes of a program.
+ * Prepared programs are cached along with it, so every change to the prepared trees must bump it.
+ */
+uint32_t const PREPARATION_VERSION = 1;
+
+/**
+ * What the preparation did, summed over all the programs the process prepared.
+ * Programs loaded from the cache are not prepared again, so they add nothing.
+ */
+struct PreparationStats {
+    std::atomic<std::size_t> deadStatements{0};
+    std::atomic<std::size_t> parallelBlocks{0};
+    std::atomic<std::size_t> sharedBodies{0};
+
+    static PreparationStats & total();
+    void print(std::ostream & out) const;
+};
+
+/**
+ * Prepares the program to run, and finds the names of all the global variables it can define.
+ * @param workers how many threads may run independent statements at once.
+ */
+std::unordered_set<std::string> preprocess(std::vector<std::unique_ptr<ast::Statement>> & prog, uint workers = std::thread::hardware_concurrency());
+
+/**
+ * Whether a variable is used after the end of the statements being prepared.
+ */
+using LiveOut = std::function<bool(std::string const & name)>;
+
+/**
+ * The variables and the fields weak references are stored in, as written in the program.
+ */
+struct WeakTargets {
+    std::unordered_set<std::string> vars;
+    std::unordered_set<std::string> fields;
+};
+
+/**
+ * Prepares a window of consecutive top-level statements of a program which is not entirely known yet.
+ * The variables `liveOut` reports are never released by the window, objects they may reference are never thread-local.
+ * Dead stores are left as is, since the reads are not known.
+ * @param weakTargets of the previous windows, the ones of this window are added.
+ * @return the names of the global variables the window can define.
+ */
+std::unordered_set<std::string> preprocessWindow(std::vector<std::unique_ptr<ast::Statement>> & window, LiveOut const & liveOut,
+                                                 WeakTargets & weakTargets, uint workers = std::thread::hardware_concurrency());
+
+/**
+ * Removes allocations whose results can never be observed, e.g. `x = object` immediately overwritten by another store to `x`.
+ * Only the top-level statements are considered; the output of `dump` and the behaviour of weak references stay the same.
+ * @return the number of removed statements.
+ */
+std::size_t removeDeadStores(std::vector<std::unique_ptr<ast::Statement>> & prog);
+
+/**
+ * Replaces runs of top-level statements (and iterations of top-level loops) touching disjoint sets of variables
+ * with `ast::Parallel` blocks of up to `workers` groups.
+ * Statements which may `dump`, start or join threads, etc. are never moved, so the output stays the same.
+ * Neither are the ones touching weak references, which may be dropped by the owners of their objects at any moment.
+ * @return the number of the blocks created.
+ */
+std::size_t parallelize(std::vector<std::unique_ptr<ast::Statement>> & prog, uint workers);
+
+/**
+ * Makes the threads with identical prepared bodies share one body and one capture set, and frees the copies.
+ * Nothing may change the bodies after that, so it goes last.
+ * @return the number of the bodies freed.
+ */
+std::size_t shareThreadBodies(std::vector<std::unique_ptr<ast::Statement>> & prog);
@@ -1,18 +1,132 @@
 #include "run.h"
 
-#include "parsing/parser.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "parsing/parallel.h"
 #include "preparation.h"
 #include "interpreter.h"
+#include "output.h"
+#include "image.h"
+#include "cache.h"
+#include "perf.h"
+
+std::string getFileContent(std::string const & path) {
+    std::ifstream file(path);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return content;
+}
 
 void run(std::string const & prog) {
-    Parser parser(prog.c_str());
-    std::vector<std::unique_ptr<ast::Statement>> statements;
-    while (parser.hasNext()) {
-        statements.push_back(parser.nextStatement());
-    }
+    run(prog, std::cout);
+}
 
-    auto globalNames = preprocess(statements);
+void run(std::string const & prog, std::ostream & out) {
+    run(prog, out, "");
+}
 
-    Interpreter interp(statements, globalNames);
+/**
+ * Parses the program and prepares it for `workers` threads.
+ */
+static ParsedProgram compile(std::string const & prog, uint workers, std::unordered_set<std::string> & globalNames) {
+    auto program = parseParallel(prog.c_str(), workers);
+    // the nodes added by the preparation go after the parsed ones
+    ast::Arena::Scope scope(*program.arenas.front());
+    globalNames = preprocess(program.statements, workers);
+    return program;
+}
+
+static void runCompiled(ParsedProgram const & program, std::unordered_set<std::string> const & globalNames,
+                        std::ostream & out, std::string const & imagePath) {
+    Output output(out);
+    auto globals = imagePath.empty() ? Globals(globalNames) : loadImage(imagePath, globalNames);
+    Interpreter interp(program.statements, std::move(globals), output);
     interp.interpret();
+    output.flush();
+}
+
+void run(std::string const & prog, std::ostream & out, std::string const & imagePath) {
+    std::unordered_set<std::string> globalNames;
+    auto program = compile(prog, std::thread::hardware_concurrency(), globalNames);
+    runCompiled(program, globalNames, out, imagePath);
+}
+
+void runCached(std::string const & prog, ScriptCache const & cache, std::ostream & out) {
+    auto workers = std::thread::hardware_concurrency();
+    std::unordered_set<std::string> globalNames;
+    ParsedProgram cached;
+    if (cache.load(prog, workers, cached, globalNames)) {
+        runCompiled(cached, globalNames, out, "");
+        return;
+    }
+    auto program = compile(prog, workers, globalNames);
+    cache.save(prog, workers, program, globalNames);
+    runCompiled(program, globalNames, out, "");
+}
+
+RunStats runMeasured(std::string const & prog, std::ostream & out, bool timeStatements) {
+    RunStats stats;
+    HeapStats heapStats;
+    HeapStats::current = &heapStats;
+    StatementTimes statementTimes;
+    StatementTimes::current = timeStatements ? &statementTimes : nullptr;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        run(prog, out);
+        stats.ok = true;
+    } catch (std::exception & ex) {
+        stats.error = ex.what();
+    }
+    auto finish = std::chrono::steady_clock::now();
+    HeapStats::current = nullptr;
+    StatementTimes::current = nullptr;
+
+    stats.wallMs = std::chrono::duration<double, std::milli>(finish - start).count();
+    stats.peakObjects = heapStats.getPeak();
+    stats.statements = statementTimes.count();
+    stats.p50StatementUs = statementTimes.quantile(0.5);
+    stats.p99StatementUs = statementTimes.quantile(0.99);
+    return stats;
+}
+
+void runWithPerfCounters(std::string const & prog, std::ostream & out, std::ostream & report) {
+    PerfReport perf;
+    PerfCounters counters;
+    perf.error = counters.getError();
+    PerfReport::current = &perf;
+    auto phaseStart = counters.read();
+    auto endPhase = [&](std::string const & phase) {
+        auto now = counters.read();
+        perf.add(phase, now - phaseStart);
+        phaseStart = now;
+    };
+
+    try {
+        auto workers = std::thread::hardware_concurrency();
+        auto program = std::make_unique<ParsedProgram>(parseParallel(prog.c_str(), workers));
+        endPhase("lex/parse");
+        std::unordered_set<std::string> globalNames;
+        {
+            ast::Arena::Scope scope(*program->arenas.front());
+            globalNames = preprocess(program->statements, workers);
+        }
+        endPhase("preprocess");
+        Output output(out);
+        auto interp = std::make_unique<Interpreter>(program->statements, globalNames, output);
+        interp->interpret();
+        output.flush();
+        endPhase("execute");
+        interp.reset();
+        program.reset();
+        endPhase("teardown");
+    } catch (...) {
+        // what was counted before the error is still of interest
+        PerfReport::current = nullptr;
+        perf.print(report);
+        throw;
+    }
+    PerfReport::current = nullptr;
+    perf.print(report);
 }
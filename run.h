@@ -1,5 +1,46 @@
 #pragma once
 
+#include <ostream>
 #include <string>
 
+std::string getFileContent(std::string const & path);
+
 void run(std::string const & prog);
+
+void run(std::string const & prog, std::ostream & out);
+
+/**
+ * Runs the program starting with the variables saved in the heap image, empty `imagePath` means no image.
+ */
+void run(std::string const & prog, std::ostream & out, std::string const & imagePath);
+
+class ScriptCache;
+
+/**
+ * Runs the program compiled before if the cache has it, and caches it otherwise.
+ */
+void runCached(std::string const & prog, ScriptCache const & cache, std::ostream & out);
+
+struct RunStats {
+    bool ok = false;
+    std::string error;
+    double wallMs = 0;
+    std::size_t peakObjects = 0;
+    // only if the statements are timed
+    std::size_t statements = 0;
+    double p50StatementUs = 0;
+    double p99StatementUs = 0;
+};
+
+/**
+ * Runs the program, catching its errors and measuring its wall time and peak of live objects,
+ * as well as the latencies of its statements if `timeStatements` is set, which slows it down a little.
+ */
+RunStats runMeasured(std::string const & prog, std::ostream & out, bool timeStatements = false);
+
+/**
+ * Runs the program and writes the hardware counters of each of its phases, and of each thread it starts, to `report`.
+ * Parsing and lexing go together, as the parser pulls tokens from the lexer.
+ * The phases are counted on the calling thread only.
+ */
+void runWithPerfCounters(std::string const & prog, std::ostream & out, std::ostream & report);
@@ -0,0 +1,243 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <streambuf>
+#include <system_error>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "run.h"
+
+/**
+ * Writes straight to a socket.
+ */
+class SocketBuf : public std::streambuf {
+public:
+    explicit SocketBuf(int fd) : fd(fd) {}
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        char c = traits_type::to_char_type(ch);
+        return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+    }
+
+    std::streamsize xsputn(char const * data, std::streamsize size) override {
+        std::streamsize sent = 0;
+        while (sent < size) {
+            // a gone client must not kill the server with SIGPIPE
+            auto res = send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                break;
+            }
+            sent += res;
+        }
+        return sent;
+    }
+private:
+    int fd;
+};
+
+sockaddr_un makeAddress(std::string const & socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), socketPath);
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+std::string readAll(int fd) {
+    std::string content;
+    char buf[64 * 1024];
+    while (true) {
+        auto res = recv(fd, buf, sizeof(buf), 0);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            throw std::system_error(errno, std::generic_category(), "recv");
+        }
+        if (res == 0) {
+            return content;
+        }
+        content.append(buf, res);
+    }
+}
+
+/**
+ * Removes the socket a previous server left at the path, if it's not serving anymore.
+ * Anything else at the path is left alone, and the new server fails to bind.
+ */
+void removeStaleSocket(std::string const & socketPath, sockaddr_un const & address) {
+    struct stat st{};
+    if (lstat(socketPath.c_str(), &st) < 0) {
+        return; // nothing there, or bind reports why
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        throw std::system_error(EEXIST, std::generic_category(), socketPath);
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    bool isServing = connect(probe, (sockaddr const *) &address, sizeof(address)) == 0;
+    close(probe);
+    if (isServing) {
+        throw std::system_error(EADDRINUSE, std::generic_category(), socketPath);
+    }
+    unlink(socketPath.c_str());
+}
+
+Server::Server(std::string socketPath)
+        : socketPath(std::move(socketPath))
+        , listener(-1)
+        , activeHandlers(0)
+        , requests(0) {
+    auto address = makeAddress(this->socketPath);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    try {
+        removeStaleSocket(this->socketPath, address);
+    } catch (...) {
+        close(listener);
+        throw;
+    }
+    if (bind(listener, (sockaddr *) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        auto error = errno;
+        close(listener);
+        throw std::system_error(error, std::generic_category(), this->socketPath);
+    }
+}
+
+Server::~Server() {
+    close(listener);
+    unlink(socketPath.c_str());
+}
+
+void Server::serve(std::ostream & log) {
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0 && errno == EINTR) {
+            continue;
+        }
+        if (client < 0) {
+            break; // stopped
+        }
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            activeHandlers += 1;
+        }
+        std::thread([this, client, & log]() {
+            handle(client, log);
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            activeHandlers -= 1;
+            handlersDone.notify_all();
+        }).detach();
+    }
+
+    auto lock = std::unique_lock<std::mutex>(mutex);
+    handlersDone.wait(lock, [this]() { return activeHandlers == 0; });
+}
+
+void Server::stop() {
+    shutdown(listener, SHUT_RDWR);
+}
+
+void Server::handle(int client, std::ostream & log) {
+    std::string prog;
+    try {
+        prog = readAll(client);
+    } catch (std::system_error & ex) {
+        close(client);
+        return;
+    }
+
+    SocketBuf buf(client);
+    std::ostream out(&buf);
+    auto stats = runMeasured(prog, out);
+    out << "=== ";
+    if (stats.ok) {
+        out << "ok";
+    } else {
+        out << "error (" << stats.error << ")";
+    }
+    out << ", " << stats.wallMs << " ms, peak " << stats.peakObjects << " objects" << std::endl;
+
+    // logged before replying, so that the requests of a client are logged in the order it sends them
+    auto percentiles = recordLatency(stats.wallMs);
+    std::stringstream line;
+    line << (stats.ok ? "ok" : "error") << ", " << stats.wallMs << " ms (" << percentiles << ")" << std::endl;
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        log << line.str();
+    }
+    close(client);
+}
+
+std::string Server::recordLatency(double ms) {
+    std::vector<double> sorted;
+    std::size_t total;
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        if (latencies.size() < LATENCY_WINDOW) {
+            latencies.push_back(ms);
+        } else {
+            latencies[requests % LATENCY_WINDOW] = ms;
+        }
+        total = ++requests;
+        sorted = latencies;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&sorted](double p) {
+        return sorted[std::min(sorted.size() - 1, (std::size_t) (p * sorted.size()))];
+    };
+    std::stringstream buf;
+    buf << total << " requests, p50 " << percentile(0.5) << " ms, p90 " << percentile(0.9)
+        << " ms, p99 " << percentile(0.99) << " ms";
+    if (total > sorted.size()) {
+        buf << " of the last " << sorted.size();
+    }
+    return buf.str();
+}
+
+bool submit(std::string const & socketPath, std::string const & prog, std::ostream & out) {
+    auto address = makeAddress(socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    if (connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+        auto error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), socketPath);
+    }
+    SocketBuf buf(fd);
+    std::ostream(&buf) << prog << std::flush;
+    shutdown(fd, SHUT_WR);
+
+    std::string response;
+    try {
+        response = readAll(fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    out << response;
+    auto status = response.rfind("=== ");
+    return status != std::string::npos && response.compare(status, 6, "=== ok") == 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Keeps a warm runtime and runs the scripts submitted over a local Unix socket.
+ * A client sends a script and shuts its side of the connection down,
+ * the server runs the script with a fresh interpreter, streaming its output back,
+ * and ends the response with a `=== ` line containing the status and timing of the run.
+ */
+class Server {
+public:
+    explicit Server(std::string socketPath);
+    Server(Server const & that) = delete;
+    Server & operator =(Server const & that) = delete;
+    ~Server();
+    /**
+     * Accepts clients, each one in its own thread, until `stop` is called.
+     * Reports the latency of each request, along with the percentiles over the recent ones, to `log`.
+     */
+    void serve(std::ostream & log);
+    void stop();
+private:
+    void handle(int client, std::ostream & log);
+    std::string recordLatency(double ms);
+
+    std::string socketPath;
+    int listener;
+    std::mutex mutex; // guards everything below
+    std::condition_variable handlersDone;
+    uint activeHandlers;
+    static std::size_t const LATENCY_WINDOW = 1024;
+    std::vector<double> latencies; // of the last `LATENCY_WINDOW` requests, a ring
+    std::size_t requests;
+};
+
+/**
+ * Sends the script to a server and writes the response to `out`.
+ * @return whether the script succeeded.
+ */
+bool submit(std::string const & socketPath, std::string const & prog, std::ostream & out);
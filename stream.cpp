@@ -0,0 +1,301 @@
+#include "stream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parsing/parser.h"
+#include "preparation.h"
+#include "interpreter.h"
+#include "output.h"
+
+/**
+ * A read-only mapping of a whole file, followed by at least one zero byte, so it's a null-terminated string.
+ */
+class MappedSource {
+public:
+    explicit MappedSource(std::string const & path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) < 0) {
+            auto error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        // the file is mapped over zeroed pages, one page longer than needed,
+        // so the terminating null is there even if the file fills its last page
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto size = static_cast<std::size_t>(st.st_size);
+        mappedSize = (size / page + 1) * page;
+        data = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data != MAP_FAILED && size > 0 && mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            auto error = errno;
+            munmap(data, mappedSize);
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        auto error = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), path);
+        }
+    }
+
+    MappedSource(MappedSource const & that) = delete;
+    MappedSource & operator =(MappedSource const & that) = delete;
+
+    ~MappedSource() {
+        munmap(data, mappedSize);
+    }
+
+    [[nodiscard]] char const * text() const {
+        return static_cast<char const *>(data);
+    }
+private:
+    void * data;
+    std::size_t mappedSize;
+};
+
+/**
+ * Where each variable name is mentioned in the script for the last time, found by the lexer alone.
+ */
+class LastMentions {
+public:
+    explicit LastMentions(char const * text) {
+        Lexer lexer(text);
+        // the two previous tokens, to tell names of variables from names of fields and loop counters
+        auto before = Token::Kind::End;
+        auto previous = Token::Kind::End;
+        for (auto token = lexer.next(); token.kind != Token::Kind::End; token = lexer.next()) {
+            if (token.kind == Token::Kind::Comment) {
+                continue;
+            }
+            if (token.kind == Token::Kind::Ident && before == Token::Kind::Repeat) {
+                counters.insert(token.range);
+            } else if (token.kind == Token::Kind::Ident && previous != Token::Kind::Dot) {
+                auto offset = static_cast<std::size_t>(token.range.data() - text);
+                if (token.range.find('$') == std::string_view::npos) {
+                    exact[token.range] = offset;
+                } else {
+                    templates[token.range] = offset;
+                }
+            }
+            before = previous;
+            previous = token.kind;
+        }
+    }
+
+    /**
+     * Whether the script may mention the variable at `offset` or later.
+     */
+    [[nodiscard]] bool mentionedAfter(std::string const & name, std::size_t offset) const {
+        auto found = exact.find(name);
+        if (found != exact.end() && found->second >= offset) {
+            return true;
+        }
+        for (auto & [pattern, last] : templates) {
+            if (last >= offset && matches(pattern, name)) {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    /**
+     * Whether some values of the loop counters turn the name with placeholders into `name`.
+     */
+    [[nodiscard]] bool matches(std::string_view pattern, std::string_view name) const {
+        auto placeholder = pattern.find('$');
+        if (placeholder == std::string_view::npos) {
+            return pattern == name;
+        }
+        if (pattern.substr(0, placeholder) != name.substr(0, placeholder)) {
+            return false;
+        }
+        pattern.remove_prefix(placeholder);
+        name.remove_prefix(placeholder);
+        for (auto & counter : counters) {
+            if (pattern.substr(1, counter.size()) != counter) {
+                continue;
+            }
+            auto rest = pattern.substr(1 + counter.size());
+            for (std::size_t digits = 1; digits <= name.size() && std::isdigit(name[digits - 1]); ++digits) {
+                if (matches(rest, name.substr(digits))) {
+                    return true;
+                }
+            }
+        }
+        // placeholders of unknown counters are left as is
+        return !name.empty() && name[0] == '$' && matches(pattern.substr(1), name.substr(1));
+    }
+
+    // views into the mapped script
+    std::unordered_map<std::string_view, std::size_t> exact;
+    std::unordered_map<std::string_view, std::size_t> templates;
+    std::unordered_set<std::string_view> counters;
+};
+
+/**
+ * Consecutive top-level statements, prepared to run.
+ */
+struct Window {
+    // holds the nodes of the statements, so it goes first, and a window is never assigned to
+    std::unique_ptr<ast::Arena> arena = std::make_unique<ast::Arena>();
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    std::unordered_set<std::string> names;
+    std::exception_ptr error; // of the parser, right after the statements
+};
+
+/**
+ * Windows passed from the parser thread to the interpreter, no more than `capacity` at once.
+ */
+class WindowQueue {
+public:
+    explicit WindowQueue(std::size_t capacity) : capacity(capacity) {}
+
+    /**
+     * @return false if the interpreter is not interested anymore.
+     */
+    bool push(Window && window) {
+        std::unique_lock lock(mutex);
+        notFull.wait(lock, [this]() { return windows.size() < capacity || cancelled; });
+        if (cancelled) {
+            return false;
+        }
+        windows.push_back(std::move(window));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    void finish() {
+        std::lock_guard lock(mutex);
+        finished = true;
+        notEmpty.notify_one();
+    }
+
+    /**
+     * @return nothing if all the windows are taken and no more will come.
+     */
+    std::optional<Window> pop() {
+        std::unique_lock lock(mutex);
+        notEmpty.wait(lock, [this]() { return !windows.empty() || finished; });
+        if (windows.empty()) {
+            return std::nullopt;
+        }
+        std::optional<Window> window(std::move(windows.front()));
+        windows.pop_front();
+        notFull.notify_one();
+        return window;
+    }
+
+    void cancel() {
+        std::lock_guard lock(mutex);
+        cancelled = true;
+        notFull.notify_one();
+    }
+private:
+    std::size_t const capacity;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<Window> windows;
+    bool finished = false;
+    bool cancelled = false;
+};
+
+bool startsThreads(ast::Statement & stat) {
+    if (dynamic_cast<ast::NewThread *>(&stat) != nullptr) {
+        return true;
+    }
+    auto loop = dynamic_cast<ast::Repeat *>(&stat);
+    return loop != nullptr && std::any_of(loop->body.begin(), loop->body.end(), [](auto & inner) {
+        return startsThreads(*inner);
+    });
+}
+
+void parseWindows(char const * text, LastMentions const & mentions, std::size_t windowSize, WindowQueue & queue) {
+    try {
+        Parser parser(text);
+        WeakTargets weakTargets;
+        bool failed = false;
+        while (!failed && parser.hasNext()) {
+            Window window;
+            ast::Arena::Scope scope(*window.arena);
+            try {
+                while (parser.hasNext() && window.statements.size() < windowSize) {
+                    window.statements.push_back(parser.nextStatement());
+                }
+            } catch (SyntaxError & err) {
+                // the statements parsed before the error still run
+                window.error = std::current_exception();
+                failed = true;
+            }
+            auto end = parser.offset();
+            window.names = preprocessWindow(window.statements, [&mentions, end, failed](std::string const & name) {
+                return !failed && mentions.mentionedAfter(name, end);
+            }, weakTargets);
+            if (!queue.push(std::move(window))) {
+                return;
+            }
+        }
+    } catch (...) {
+        Window failed;
+        failed.error = std::current_exception();
+        queue.push(std::move(failed));
+    }
+    queue.finish();
+}
+
+void runStreaming(std::string const & path, std::ostream & out, std::size_t window) {
+    MappedSource source(path);
+    LastMentions mentions(source.text());
+    WindowQueue queue(4);
+    std::thread parser(parseWindows, source.text(), std::cref(mentions), std::max<std::size_t>(window, 1), std::ref(queue));
+
+    // running threads execute the bodies from these windows, so they must outlive the interpreter
+    std::vector<Window> withThreads;
+    std::vector<std::unique_ptr<ast::Statement>> noStatements;
+    Output output(out);
+    try {
+        Interpreter interp(noStatements, std::unordered_set<std::string>(), output);
+        while (auto popped = queue.pop()) {
+            auto & next = *popped;
+            interp.globals.declare(next.names);
+            for (auto & stat : next.statements) {
+                interp.interpret(stat);
+            }
+            auto error = next.error;
+            if (std::any_of(next.statements.begin(), next.statements.end(), [](auto & stat) { return startsThreads(*stat); })) {
+                withThreads.push_back(std::move(next));
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        interp.finish();
+    } catch (...) {
+        queue.cancel();
+        parser.join();
+        throw;
+    }
+    parser.join();
+    output.flush();
+}
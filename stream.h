@@ -0,0 +1,13 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+/**
+ * Runs a script while it's still being parsed.
+ * The file is mapped into memory and scanned by the lexer once, to find where each variable is mentioned for the last time.
+ * Then a parser thread prepares windows of `window` top-level statements, while the interpreter runs the previous ones,
+ * so only a few windows are in memory at once.
+ * A syntax error stops the script once the interpreter reaches it, the statements before it are run.
+ */
+void runStreaming(std::string const & path, std::ostream & out, std::size_t window = 1024);
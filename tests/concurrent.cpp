@@ -3,9 +3,19 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
 #include "helper.h"
 #include "../run.h"
 #include "../mm.h"
+#include "../interpreter.h"
+#include "../output.h"
+#include "../preparation.h"
+#include "../parsing/parser.h"
+#include "../parsing/parallel.h"
 
 extern "C" {
     void __tsan_on_report() {
@@ -30,7 +40,7 @@ TEST(Concurent, CounterIncs) {
                 repeat(OPS, "o", {"var_$t_$o = obj"}),
             "}",
         }),
-        "sleep",
+        "join all",
         "dump obj",
     }));
     std::string output = testing::internal::GetCapturedStdout();
@@ -55,7 +65,7 @@ TEST(Concurent, CounterDecs) {
                 repeat(OPS, "o", {"var_$t_$o = object"}),
             "}",
         }),
-        "sleep",
+        "join all",
         "dump obj",
     }));
     std::string output = testing::internal::GetCapturedStdout();
@@ -90,7 +100,7 @@ TEST(Concurent, CounterIncsDesc) {
             repeat(OPS, "o", {"var_dec_$t_$o = object"}),
             "}",
         }),
-        "sleep",
+        "join all",
         "dump obj",
     }));
     std::string output = testing::internal::GetCapturedStdout();
@@ -126,7 +136,7 @@ TEST(Concurent, WeakCounterIncsDesc) {
             repeat(OPS, "o", {"var_dec_$t_$o = object"}),
             "}",
         }),
-        "sleep",
+        "join all",
         "dump weak",
         "dump obj", // keep obj alive
     }));
@@ -139,4 +149,264 @@ TEST(Concurent, WeakCounterIncsDesc) {
     ));
 }
 
+TEST(Concurent, InflatedCounterFreesExactly) {
+    uint const THREADS = 8;
+    uint const OPS = 1000;
+    HeapStats heapStats;
+    HeapStats::current = &heapStats;
+    {
+        auto obj = RefToObj::newStrong(new Object("obj", false));
+        obj->inflate();
+        std::vector<std::vector<RefToObj>> refs(THREADS);
+        std::vector<std::thread> threads;
+        for (uint t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&obj, &refs, t, OPS]() {
+                for (uint o = 0; o < OPS; ++o) {
+                    refs[t].push_back(RefToObj::makeStrong(obj));
+                }
+            });
+        }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        ASSERT_TRUE(obj->isInflated());
+        ASSERT_EQ(obj->getRefCounter(), THREADS * OPS + 1);
+
+        // each thread drops the references counted by another one
+        threads.clear();
+        for (uint t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&refs, t, THREADS]() {
+                refs[(t + 1) % THREADS].clear();
+            });
+        }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        ASSERT_FALSE(obj->isInflated());
+        ASSERT_EQ(obj->getRefCounter(), 1);
+        ASSERT_EQ(heapStats.getLive(), 1);
+    }
+    ASSERT_EQ(heapStats.getLive(), 0);
+    HeapStats::current = nullptr;
+}
+
+TEST(Concurent, UpgradesRaceDeath) {
+    uint const ROUNDS = 1000;
+    HeapStats heapStats;
+    HeapStats::current = &heapStats;
+    for (uint round = 0; round < ROUNDS; ++round) {
+        auto obj = RefToObj::newStrong(new Object("obj", false));
+        auto weak = RefToObj::makeWeak(obj);
+        std::thread upgrader([&weak, &heapStats]() {
+            HeapStats::current = &heapStats;
+            // each upgrade either owns the object or sees it collected, which is final
+            while (!RefToObj::upgrade(weak).isEmpty()) {}
+        });
+        obj = RefToObj();
+        upgrader.join();
+        ASSERT_THROW(RefToObj::makeStrong(weak), WeakRef::InvalidAccess);
+        ASSERT_EQ(weak.getRaw()->getRefCounter(), 1);
+    }
+    ASSERT_EQ(heapStats.getLive(), 0);
+    HeapStats::current = nullptr;
+}
+
+TEST(Concurent, RestoredObjectsArePublished) {
+    // restored objects start thread-local, and get shared when a thread captures them
+    auto image = (std::filesystem::temp_directory_path() / ("arc_concurrent_image_" + std::to_string(getpid()))).string();
+    run(prog({
+        "obj = object",
+        "obj.child = object",
+        "checkpoint \"" + image + "\"",
+    }));
+    testing::internal::CaptureStdout();
+    run(prog({
+        "repeat 8 t {",
+            "thread {",
+                "repeat 1000 o {",
+                    "var_$t_$o = obj.child",
+                "}",
+            "}",
+        "}",
+        "join all",
+        "dump obj.child",
+    }), std::cout, image);
+    std::string output = testing::internal::GetCapturedStdout();
+    std::filesystem::remove(image);
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump obj.child: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Concurent, CounterIncsInLoops) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "obj = object",
+        "repeat 8 t {",
+            "repeat 1000 o {",
+                "var_$t_$o = object",
+            "}",
+        "}",
+        "dump obj",
+        "repeat 8 t {",
+            "thread {",
+                "repeat 1000 o {",
+                    "var_$t_$o = obj",
+                "}",
+            "}",
+        "}",
+        "join all",
+        "dump obj",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump obj: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+        R"--(dump obj: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Concurent, DumpsAreNotInterleaved) {
+    uint const THREADS = 8;
+    uint const OPS = 500;
+    testing::internal::CaptureStdout();
+    run(prog({
+        "obj = object",
+        repeat(THREADS, "t", {
+            "thread {",
+                repeat(OPS, "o", {"dump obj"}),
+            "}",
+        }),
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    std::string line;
+    std::stringstream lines(output);
+    uint count = 0;
+    while (std::getline(lines, line)) {
+        ASSERT_THAT(line, MatchesRegex(R"--(dump obj: strong\(\w+\), obj refCounter = [0-9]+, fields = \{\})--"));
+        count += 1;
+    }
+    ASSERT_EQ(count, THREADS * OPS);
+}
+
+TEST(Concurent, IndependentStatementsRunInParallel) {
+    auto source = prog({
+        "obj = object",
+        "obj.child = object",
+        "other = obj.child",
+        "dump other",
+        "repeat 8 t {",
+            "repeat 500 o {",
+                "var_$t_$o = obj",
+            "}",
+        "}",
+        "repeat 4 t {",
+            "repeat 500 o {",
+                "other_$t_$o = other",
+            "}",
+        "}",
+        "dump obj",
+        "dump other",
+        "repeat 8 t {",
+            "repeat 500 o {",
+                "keep = var_$t_$o",
+            "}",
+        "}",
+        "repeat 4 t {",
+            "repeat 500 o {",
+                "keep = other_$t_$o",
+            "}",
+        "}",
+    });
+    auto statements = parse(source);
+    auto names = preprocess(statements, 4);
+    ASSERT_TRUE(std::any_of(statements.begin(), statements.end(), [](auto & stat) {
+        return dynamic_cast<ast::Parallel *>(stat.get()) != nullptr;
+    }));
+
+    testing::internal::CaptureStdout();
+    {
+        Output output(std::cout);
+        Interpreter interp(statements, names, output);
+        interp.interpret();
+        output.flush();
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump other: strong\(\w+\), obj refCounter = 2, fields = \{\}\s*)--"
+        R"--(dump obj: strong\(\w+\), obj refCounter = 4001, fields = \{child: strong\(\w+\)\}\s*)--"
+        R"--(dump other: strong\(\w+\), obj refCounter = 2002, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Concurent, WeakReadsAreNotParallel) {
+    // `y = wx` reads through a weak reference, nothing tells it apart from `x` by the names
+    auto source = prog({
+        "x = object",
+        "wx ~= x",
+        "sleep",
+        "repeat 1500 {",
+            "y = object",
+        "}",
+        "y = wx",
+        "repeat 2000 {",
+            "x = object",
+        "}",
+        "repeat 3000 {",
+            "a_$i = object",
+        "}",
+        "dump y",
+    });
+    for (uint run = 0; run < 10; ++run) {
+        auto statements = parse(source);
+        auto names = preprocess(statements, 4);
+
+        testing::internal::CaptureStdout();
+        {
+            Output output(std::cout);
+            Interpreter interp(statements, names, output);
+            interp.interpret();
+            output.flush();
+        }
+        std::string output = testing::internal::GetCapturedStdout();
+        ASSERT_THAT(output, MatchesRegex(R"--(dump y: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"));
+    }
+}
+
+TEST(Concurent, ParallelParsingMatchesSequential) {
+    auto source = prog({
+        "a =",
+        "    object(first)",
+        "// a comment with braces } {",
+        "t = thread {",
+            "b = object",
+            "",
+            "b.prev = a",
+            "repeat 2 i {",
+                "c_$i",
+                "    = b",
+            "}",
+        "}",
+        "checkpoint \"not } a brace\"",
+        "join t",
+        "repeat 3 i { d_$i = object }",
+        "dump",
+        "    a",
+    });
+    std::stringstream sequential;
+    for (auto & stat : parse(source)) {
+        stat->print(sequential);
+        sequential << std::endl;
+    }
+
+    for (uint workers = 2; workers <= 8; ++workers) {
+        auto program = parseParallel(source.c_str(), workers, 1);
+        std::stringstream parallel;
+        for (auto & stat : program.statements) {
+            stat->print(parallel);
+            parallel << std::endl;
+        }
+        ASSERT_EQ(parallel.str(), sequential.str()) << workers << " workers";
+    }
+}
+
 #pragma clang diagnostic pop
\ No newline at end of file
@@ -3,8 +3,28 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <regex>
+#include <set>
+#include <thread>
+#include <unistd.h>
+
 #include "helper.h"
 #include "../run.h"
+#include "../batch.h"
+#include "../server.h"
+#include "../image.h"
+#include "../stream.h"
+#include "../cache.h"
+#include "../parsing/parser.h"
+#include "../parsing/parallel.h"
+#include "../preparation.h"
+#include "../mm.h"
+#include "../perf.h"
 
 // FIXME throw from a non-main thread can not be caught
 
@@ -68,6 +88,37 @@ TEST(Lang, ThreadCanAccessForeignGlobal) {
     }));
 }
 
+TEST(Lang, JoinWaitsForThread) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "x = object",
+        "wx ~= x",
+        "t = thread {",
+            "sleep",
+            "y = x",
+        "}",
+        "dump wx",
+        "join t",
+        "dump wx",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump wx: weak\(\w+ -> \w+\), weak refCounter = 2, obj refCounter = 1, fields = \{\}\s+)--"
+        R"--(dump wx: weak\(\w+ -> 0\), weak refCounter = 1, obj collected\s*)--"
+    ));
+}
+
+TEST(Lang, JoinOfUnknownThreadIsErr) {
+    ASSERT_ANY_THROW(
+        run(prog({
+            "t = thread {",
+                "x = object",
+            "}",
+            "join u",
+        }));
+    );
+}
+
 TEST(Lang, AssignmentIncrementsCounter) {
     testing::internal::CaptureStdout();
     run(prog({
@@ -143,6 +194,29 @@ TEST(Lang, GlobalDiesWithLastThread) {
     ));
 }
 
+TEST(Lang, GlobalDiesAtLastUseInThread) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "repeat 2 t {",
+            "obj_$t = object",
+            "thread {",
+                "sleep", // let the main thread release its references
+                "a_$t = obj_$t",
+                "repeat 2 i {",
+                    "b_$t_$i = a_$t",
+                "}",
+                "dump a_$t",
+            "}",
+        "}",
+        "join all",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump a_\$t: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+        R"--(dump a_\$t: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
 TEST(Lang, WeakRefsAreFreed) {
     testing::internal::CaptureStdout();
     run(prog({
@@ -246,4 +320,673 @@ TEST(Lang, TheCircleOfAlive) {
     ));
 }
 
+TEST(Lang, RepeatSubstitutesCounter) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "repeat 3 {",
+            "x_$i = object",
+        "}",
+        "repeat 2 a {",
+            "repeat 3 b {",
+                "y_$a_$b = x_$b",
+            "}",
+        "}",
+        "dump x_0",
+        "dump y_1_2",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump x_0: strong\(\w+\), obj refCounter = 1, fields = \{\}\s+)--"
+        R"--(dump y_1_2: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Lang, RepeatCountMustBeNumber) {
+    ASSERT_ANY_THROW(
+        run(prog({
+            "repeat x {",
+                "y = object",
+            "}",
+        }));
+    );
+}
+
+TEST(Lang, NestedCountersMustNotSharePrefix) {
+    ASSERT_THROW(
+        run(prog({
+            "repeat 2 a {",
+                "repeat 2 ab {",
+                    "y_$ab = object",
+                "}",
+            "}",
+        })),
+        SyntaxError
+    );
+    ASSERT_THROW(
+        run(prog({
+            "repeat 2 ab {",
+                "repeat 2 a {",
+                    "y_$ab = object",
+                "}",
+            "}",
+        })),
+        SyntaxError
+    );
+    // sibling loops and shadowing are fine
+    testing::internal::CaptureStdout();
+    run(prog({
+        "repeat 2 a {",
+            "repeat 2 a {",
+                "x_$a = object",
+            "}",
+        "}",
+        "repeat 2 ab {",
+            "y_$ab = x_$ab",
+        "}",
+        "dump y_1",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump y_1: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Lang, GlobalDiesAtLastUseInLoop) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "x = object",
+        "wx ~= x",
+        "repeat 3 {",
+            "y_$i = x",
+            // the previous `y_$i` is already dead
+            "dump y_$i",
+        "}",
+        // x dies here
+        "dump wx",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump y_\$i: strong\(\w+\), obj refCounter = 2, fields = \{\}\s+)--"
+        R"--(dump y_\$i: strong\(\w+\), obj refCounter = 2, fields = \{\}\s+)--"
+        R"--(dump y_\$i: strong\(\w+\), obj refCounter = 2, fields = \{\}\s+)--"
+        R"--(dump wx: weak\(\w+ -> 0\), weak refCounter = 1, obj collected\s*)--"
+    ));
+}
+
+TEST(Lang, ThreadInLoopCapturesItsGlobals) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "repeat 2 t {",
+            "thread {",
+                "repeat 3 o {",
+                    "v_$t_$o = object",
+                "}",
+            "}",
+        "}",
+        "join all",
+        "dump v_1_2",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump v_1_2: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Lang, FrozenFieldsAreReadOnly) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "x = object",
+        "x.child = object",
+        "freeze x",
+        repeat(4, "t", {
+            "thread {",
+                "var_$t = x.child",
+            "}",
+        }),
+        "join all",
+        "dump x",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump x: strong\(\w+\), obj refCounter = 1, frozen, fields = \{child: strong\(\w+\)\}\s*)--"
+    ));
+    ASSERT_THROW(run(prog({"x = object", "freeze x", "x.child = object", "dump x.child"})), Fields::FrozenWrite);
+}
+
+TEST(Lexer, VectorizedScannersMatchScalar) {
+    std::string script =
+        "a_very_long_identifier_with_$counter_and_more_than_32_characters = object(named)\n"
+        "\t\r\n  \v\f   x.field ~= y // a comment longer than a vector register, with \"quotes\"\n"
+        "objects = object sleep sleepr sleeps s dump dumps join joint checkpoint \"some/path\" \"unterminated\n"
+        "repeat 10 i { thread { z_$i = object } }\n"
+        "// a comment at the very end";
+    auto tokens = [](char const * text, scan::Isa isa) {
+        std::vector<std::pair<Token::Kind, std::string_view>> result;
+        Lexer lexer(text, isa);
+        for (auto token = lexer.next(); token.kind != Token::Kind::End; token = lexer.next()) {
+            result.emplace_back(token.kind, token.range);
+        }
+        return result;
+    };
+    // every alignment of the text relative to the vector registers
+    for (std::size_t shift = 0; shift < 32; ++shift) {
+        auto shifted = std::string(shift, ' ') + script;
+        auto expected = tokens(shifted.c_str(), scan::Isa::Scalar);
+        ASSERT_EQ(expected.size(), 38);
+        for (auto isa : {scan::Isa::Sse2, scan::Isa::Avx2}) {
+            ASSERT_EQ(tokens(shifted.c_str(), isa), expected);
+        }
+    }
+}
+
+TEST(Ast, NodesGoIntoInstalledArena) {
+    auto source = prog({
+        "a = object(first)",
+        "repeat 2 i {",
+        "    b_$i = object",
+        "    b_$i.prev = a",
+        "}",
+    });
+    ast::Arena arena;
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    {
+        ast::Arena::Scope scope(arena);
+        statements = parse(source);
+    }
+    auto bytes = arena.bytes();
+    ASSERT_GT(bytes, 0);
+    // laid out in the parse order
+    ASSERT_LT(static_cast<void *>(statements[0].get()), static_cast<void *>(statements[1].get()));
+
+    // outside of the scope, nodes are on the heap, and both kinds are deleted the same way
+    statements.push_back(std::make_unique<ast::EndOfLife>("a"));
+    ASSERT_EQ(arena.bytes(), bytes);
+    statements.erase(statements.begin());
+    std::stringstream printed;
+    for (auto & stat : statements) {
+        stat->print(printed);
+    }
+    ASSERT_THAT(printed.str(), testing::HasSubstr("b_$i.prev = a"));
+}
+
+TEST(Ast, ParallelParsingReportsFirstError) {
+    auto source = prog({
+        "a = object",
+        "t = thread {",
+            "b = object",
+            "b.prev = a",
+        "}",
+        "join t",
+        "dump a",
+        "c = = object",
+        "dump",
+    });
+    std::string expected;
+    try {
+        parse(source);
+    } catch (SyntaxError & err) {
+        expected = err.what();
+    }
+    ASSERT_THAT(expected, testing::EndsWith("expected Identifier, found ="));
+
+    for (uint workers = 1; workers <= 8; ++workers) {
+        try {
+            parseParallel(source.c_str(), workers, 1);
+            FAIL() << workers << " workers";
+        } catch (SyntaxError & err) {
+            ASSERT_EQ(err.what(), expected) << workers << " workers";
+        }
+    }
+}
+
+TEST(Preparation, MarksThreadLocalSites) {
+    auto source = prog({
+        "a = object",
+        "b = object",
+        "c = object",
+        "b.next = c",
+        "thread {",
+            "dump b",
+        "}",
+        "join all",
+        "dump a",
+    });
+    auto statements = parse(source);
+    preprocess(statements);
+
+    std::vector<bool> threadLocal;
+    for (auto & stat : statements) {
+        auto assign = dynamic_cast<ast::Assign *>(stat.get());
+        auto site = assign == nullptr ? nullptr : dynamic_cast<ast::NewObject *>(assign->from.get());
+        if (site != nullptr) {
+            threadLocal.push_back(site->threadLocal);
+        }
+    }
+    ASSERT_EQ(threadLocal, std::vector<bool>({true, false, false}));
+}
+
+TEST(Preparation, RemovesDeadStores) {
+    auto source = prog({
+        "x = object",
+        "x = object",
+        "unused = object",
+        "weak ~= x",
+        "kept = object",
+        "repeat 2 i {",
+            "copy_$i = kept",
+        "}",
+        "dump weak",
+        "dump x",
+    });
+    auto statements = parse(source);
+    ASSERT_EQ(removeDeadStores(statements), 2);
+    ASSERT_EQ(statements.size(), 6);
+    // and reported
+    auto reported = PreparationStats::total().deadStatements.load();
+    auto prepared = parse(source);
+    preprocess(prepared, 1);
+    ASSERT_EQ(PreparationStats::total().deadStatements - reported, 2);
+
+    testing::internal::CaptureStdout();
+    run(source);
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump weak: weak\(\w+ -> \w+\), weak refCounter = 2, obj refCounter = 1, fields = \{\}\s*)--"
+        R"--(dump x: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"
+    ));
+}
+
+TEST(Preparation, DoesNotUnrollLoops) {
+    // a pass per iteration would never finish
+    auto source = prog({
+        "y = object",
+        "repeat 100000000 a {",
+            "repeat 100000000 b {",
+                "x = y",
+            "}",
+        "}",
+        "thread {",
+            "repeat 100000000 o {",
+                "q = y",
+            "}",
+        "}",
+        "join all",
+        "repeat 3 a {",
+            "repeat 100000000 b {",
+                "w_$a = x",
+            "}",
+        "}",
+    });
+    auto statements = parse(source);
+    auto names = preprocess(statements, 1);
+    ASSERT_EQ(names, std::unordered_set<std::string>({"y", "x", "q", "w_0", "w_1", "w_2"}));
+}
+
+TEST(Preparation, SharesIdenticalThreadBodies) {
+    auto body = repeat(2, "o", {"copy_$o = obj", "dump copy_$o"});
+    auto source = prog({
+        "obj = object",
+        "first = thread {", body, "}",
+        "second = thread {", body, "}",
+        "other = thread {", "copy = obj", "}",
+        "join all",
+    });
+    auto program = parseParallel(source.c_str(), 1);
+    preprocess(program.statements, 1);
+    std::vector<ast::NewThread *> threads;
+    for (auto & stat : program.statements) {
+        if (auto newThread = dynamic_cast<ast::NewThread *>(stat.get())) {
+            threads.push_back(newThread);
+        }
+    }
+    ASSERT_EQ(threads.size(), 3);
+    ASSERT_EQ(threads[0]->body, threads[1]->body);
+    ASSERT_EQ(threads[0]->usedVars, threads[1]->usedVars);
+    ASSERT_NE(threads[0]->body, threads[2]->body);
+
+    testing::internal::CaptureStdout();
+    run(source);
+    std::string output = testing::internal::GetCapturedStdout();
+    ASSERT_THAT(output, MatchesRegex(R"--((dump copy_[01]: strong\(\w+\), obj refCounter = [0-9]+, fields = \{\}\s*){4})--"));
+}
+
+TEST(Checkpoint, RestoresHeap) {
+    auto image = (std::filesystem::temp_directory_path() / ("arc_image_" + std::to_string(getpid()))).string();
+    run(prog({
+        "a = object(a)",
+        "b = object(b)",
+        "a.next = b",
+        "b.back ~= a",
+        "t = object",
+        "w ~= t",
+        "t = object",
+        "freeze a",
+        "checkpoint \"" + image + "\"",
+    }));
+
+    testing::internal::CaptureStdout();
+    run(prog({
+        "dump b.back",
+        "dump a",
+        "dump a.next",
+        "dump w",
+    }), std::cout, image);
+    std::string output = testing::internal::GetCapturedStdout();
+    std::filesystem::remove(image);
+    ASSERT_THAT(output, MatchesRegex(
+        R"--(dump b.back: weak\(\w+ -> \w+\), weak refCounter = 2, obj refCounter = 1, frozen, fields = \{next: strong\(\w+\)\}\s*)--"
+        R"--(dump a: strong\(\w+\), obj refCounter = 1, frozen, fields = \{next: strong\(\w+\)\}\s*)--"
+        R"--(dump a.next: strong\(\w+\), obj refCounter = 1, fields = \{back: weak\(\w+ -> \w+\)\}\s*)--"
+        R"--(dump w: weak\(\w+ -> 0\), weak refCounter = 1, obj collected\s*)--"
+    ));
+}
+
+TEST(Cache, RoundTripsPreparedProgram) {
+    auto source = prog({
+        "shared = object(shared)",
+        "repeat 8 t {", // enough work on its own, weak stores never run in parallel
+            "repeat 500 o {",
+                "a_$t_$o = object",
+            "}",
+        "}",
+        "repeat 4 t {",
+            "repeat 500 o {",
+                "b_$t_$o ~= shared",
+            "}",
+        "}",
+        "h = thread {",
+            "local = object",
+            "local.to = shared",
+            "dump local",
+        "}",
+        "join h",
+        "checkpoint \"unused\"",
+        "freeze shared",
+        "dump shared",
+    });
+    auto print = [](ParsedProgram const & program) {
+        std::stringstream buf;
+        for (auto & stat : program.statements) {
+            stat->print(buf);
+            buf << std::endl;
+            if (auto newThread = dynamic_cast<ast::NewThread *>(stat.get())) {
+                std::set<std::string> captured(newThread->usedVars->begin(), newThread->usedVars->end());
+                buf << captured.size() << " captured" << (captured.count("shared") != 0 ? ", shared" : "") << std::endl;
+            }
+        }
+        return buf.str();
+    };
+    auto program = parseParallel(source.c_str(), 1);
+    auto globalNames = preprocess(program.statements, 4);
+    ASSERT_THAT(print(program), testing::HasSubstr("parallel {"));
+
+    auto dir = std::filesystem::temp_directory_path() / ("arc_cache_" + std::to_string(getpid()));
+    ScriptCache cache(dir.string());
+    cache.save(source, 4, program, globalNames);
+
+    ParsedProgram loaded;
+    std::unordered_set<std::string> loadedNames;
+    ASSERT_TRUE(cache.load(source, 4, loaded, loadedNames));
+    ASSERT_EQ(print(loaded), print(program));
+    ASSERT_EQ(loadedNames, globalNames);
+
+    // prepared for another number of workers, or for another source
+    ParsedProgram other;
+    ASSERT_FALSE(cache.load(source, 2, other, loadedNames));
+    ASSERT_FALSE(cache.load(source + "dump shared\n", 4, other, loadedNames));
+
+    // nor one prepared by another version of the preparation
+    auto file = std::filesystem::directory_iterator(dir)->path();
+    {
+        std::fstream stream(file, std::ios::in | std::ios::out | std::ios::binary);
+        stream.seekp(24); // `Header::preparation`
+        uint32_t version = PREPARATION_VERSION + 1;
+        stream.write(reinterpret_cast<char const *>(&version), sizeof(version));
+    }
+    ParsedProgram otherVersion;
+    ASSERT_FALSE(cache.load(source, 4, otherVersion, loadedNames));
+    cache.save(source, 4, program, globalNames);
+
+    // a truncated file is not taken
+    std::filesystem::resize_file(file, std::filesystem::file_size(file) - 1);
+    ParsedProgram truncated;
+    ASSERT_FALSE(cache.load(source, 4, truncated, loadedNames));
+    ASSERT_TRUE(truncated.statements.empty());
+    std::filesystem::remove_all(dir);
+}
+
+TEST(Cache, EvictsLeastRecentlyUsed) {
+    auto dir = std::filesystem::temp_directory_path() / ("arc_cache_" + std::to_string(getpid()));
+    std::vector<std::string> sources = {prog("a = object"), prog("b = object"), prog("c = object")};
+    std::vector<ParsedProgram> programs(sources.size());
+    std::vector<std::unordered_set<std::string>> names(sources.size());
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        programs[i].statements = parse(sources[i]);
+        names[i] = preprocess(programs[i].statements, 1);
+    }
+    ScriptCache unlimited(dir.string());
+    unlimited.save(sources[0], 1, programs[0], names[0]);
+    auto size = std::filesystem::file_size(std::filesystem::directory_iterator(dir)->path());
+
+    // room for two programs
+    ScriptCache cache(dir.string(), 2 * size);
+    cache.save(sources[1], 1, programs[1], names[1]);
+    // both are old by now, then the first one is used again
+    for (auto & entry : std::filesystem::directory_iterator(dir)) {
+        std::filesystem::last_write_time(entry.path(), std::filesystem::file_time_type::clock::now() - std::chrono::hours(1));
+    }
+    ParsedProgram used;
+    std::unordered_set<std::string> usedNames;
+    ASSERT_TRUE(cache.load(sources[0], 1, used, usedNames));
+    cache.save(sources[2], 1, programs[2], names[2]);
+
+    ParsedProgram loaded;
+    std::unordered_set<std::string> loadedNames;
+    ASSERT_TRUE(cache.load(sources[0], 1, loaded, loadedNames));
+    ASSERT_FALSE(cache.load(sources[1], 1, loaded, loadedNames));
+    ASSERT_TRUE(cache.load(sources[2], 1, loaded, loadedNames));
+    std::filesystem::remove_all(dir);
+}
+
+TEST(Stream, MatchesWholeProgramRun) {
+    auto source = prog({
+        "a = object(a)",
+        "b = object(b)",
+        "a.next = b",
+        "w ~= b",
+        "repeat 3 i {",
+            "tmp_$i = object",
+            "keep_$i = a",
+        "}",
+        "dump b",
+        "b = object",
+        "dump w",
+        "thread {",
+            "dump a",
+        "}",
+        "join all",
+        "dump a.next",
+        "repeat 3 i {",
+            "dump keep_$i",
+        "}",
+        "dump w",
+        "x = keep_1",
+        "dump a",
+    });
+    auto path = (std::filesystem::temp_directory_path() / ("arc_stream_" + std::to_string(getpid()) + ".arc")).string();
+    std::ofstream(path) << source;
+
+    std::stringstream whole;
+    run(source, whole);
+    std::stringstream streamed;
+    // a tiny window, so most variables outlive the window they are defined in
+    runStreaming(path, streamed, 2);
+    std::filesystem::remove(path);
+
+    auto withoutAddresses = [](std::string const & output) {
+        return std::regex_replace(output, std::regex("0x[0-9a-f]+"), "ptr");
+    };
+    ASSERT_FALSE(whole.str().empty());
+    ASSERT_EQ(withoutAddresses(streamed.str()), withoutAddresses(whole.str()));
+}
+
+TEST(Stream, RunsStatementsBeforeSyntaxError) {
+    auto path = (std::filesystem::temp_directory_path() / ("arc_stream_" + std::to_string(getpid()) + ".arc")).string();
+    std::ofstream(path) << prog({
+        "x = object",
+        "dump x",
+        "y = = z",
+        "dump x",
+    });
+
+    std::stringstream streamed;
+    // the statements before the error are in the same window
+    ASSERT_THROW(runStreaming(path, streamed, 64), SyntaxError);
+    std::filesystem::remove(path);
+    ASSERT_THAT(streamed.str(), MatchesRegex(R"--(dump x: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"));
+}
+
+TEST(Checkpoint, MissingImageIsErr) {
+    ASSERT_THROW(run(prog("dump x"), std::cout, "/nonexistent/arc_image"), ImageError);
+}
+
+TEST(Batch, ReportsEachScript) {
+    auto dir = std::filesystem::temp_directory_path() / ("arc_batch_" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "a.arc") << prog({
+        "x = object",
+        "y = object",
+        "dump x",
+        "dump y",
+    });
+    std::ofstream(dir / "b.arc") << prog("x = y");
+
+    std::stringstream report;
+    auto ok = runBatch(dir.string(), 2, report);
+    std::filesystem::remove_all(dir);
+
+    ASSERT_FALSE(ok);
+    ASSERT_THAT(report.str(), MatchesRegex(
+        R"--(=== .*a.arc: ok, [0-9.e-]+ ms, peak 2 objects\s+)--"
+        R"--(dump x: strong\(\w+\), obj refCounter = 1, fields = \{\}\s+)--"
+        R"--(dump y: strong\(\w+\), obj refCounter = 1, fields = \{\}\s+)--"
+        R"--(=== .*b.arc: error \(.*\), [0-9.e-]+ ms, peak 0 objects\s+)--"
+        R"--(=== 2 scripts, 1 ok, 1 failed, .*\s*)--"
+    ));
+}
+
+TEST(Batch, TimesStatementsOutsideLoops) {
+    auto source = prog({
+        "obj = object",
+        "repeat 10 i {",
+            "var_$i = obj",
+        "}",
+        "dump obj",
+    });
+    std::stringstream out;
+    ASSERT_EQ(runMeasured(source, out).statements, 0);
+    auto stats = runMeasured(source, out, true);
+    ASSERT_TRUE(stats.ok);
+    // the loop itself isn't timed, but its iterations are, along with the ends of life of the 11 variables
+    ASSERT_EQ(stats.statements, 23);
+    ASSERT_LE(stats.p50StatementUs, stats.p99StatementUs);
+}
+
+TEST(Batch, PerfCountersDegradeGracefully) {
+    // the counters are mostly unavailable in containers, each phase is reported either way
+    std::stringstream out;
+    std::stringstream report;
+    runWithPerfCounters(prog({"x = object", "dump x"}), out, report);
+    ASSERT_THAT(out.str(), MatchesRegex(R"--(dump x: strong\(\w+\), obj refCounter = 1, fields = \{\}\s*)--"));
+    ASSERT_THAT(report.str(), MatchesRegex(
+        R"--((perf counters: not all events are counted \(.*\)\s+)?)--"
+        R"--(perf counters +cycles +instructions +cache-misses +branch-misses\s+)--"
+        R"--(lex/parse( +([0-9]+|n/a)){4}\s+)--"
+        R"--(preprocess( +([0-9]+|n/a)){4}\s+)--"
+        R"--(execute( +([0-9]+|n/a)){4}\s+)--"
+        R"--(teardown( +([0-9]+|n/a)){4}\s*)--"
+    ));
+}
+
+TEST(Batch, PerfCountsScaleOnlyTheDifference) {
+    // the event counted 10% of the time before and 90% of the time after, its scaled totals would go down
+    PerfReadings earlier = {PerfReading{1000, 100, 10}};
+    PerfReadings later = {PerfReading{1500, 200, 100}, PerfReading{5, 1, 1}};
+    auto diff = later - earlier;
+    ASSERT_EQ(diff[0], std::optional<uint64_t>(555));
+    ASSERT_FALSE(diff[1]);
+    // the event didn't run in between
+    ASSERT_EQ((later - later)[0], std::optional<uint64_t>(0));
+}
+
+TEST(Stats, CountsOperations) {
+    testing::internal::CaptureStdout();
+    run(prog({
+        "x = object",
+        "stats",
+        "w ~= x",
+        "stats",
+        "dump w",
+        "dump x",
+    }));
+    std::string output = testing::internal::GetCapturedStdout();
+    std::vector<std::map<std::string, uint64_t>> stats;
+    std::regex count(R"--(([a-z_]+) = ([0-9]+))--");
+    std::string line;
+    std::stringstream lines(output);
+    while (std::getline(lines, line)) {
+        if (line.rfind("stats: ", 0) != 0) {
+            continue;
+        }
+        auto & counts = stats.emplace_back();
+        for (auto it = std::sregex_iterator(line.begin(), line.end(), count); it != std::sregex_iterator(); ++it) {
+            counts[(*it)[1]] = std::stoull((*it)[2]);
+        }
+        ASSERT_EQ(counts.size(), OpStats::OP_COUNT);
+    }
+    ASSERT_EQ(stats.size(), 2);
+    // the counts are of the whole process, only what's done in between is known
+    ASSERT_EQ(stats[1]["weak_incs"] - stats[0]["weak_incs"], 1);
+    ASSERT_EQ(stats[1]["weak_proxies"] - stats[0]["weak_proxies"], 1);
+    ASSERT_EQ(stats[1]["global_puts"] - stats[0]["global_puts"], 1);
+    ASSERT_EQ(stats[1]["objects_freed"] - stats[0]["objects_freed"], 0);
+}
+
+TEST(Server, RunsSubmittedScripts) {
+    auto socketPath = (std::filesystem::temp_directory_path() / ("arc_server_" + std::to_string(getpid()))).string();
+    Server server(socketPath);
+    std::stringstream log;
+    std::thread serving([&server, &log]() { server.serve(log); });
+
+    std::stringstream first;
+    auto firstOk = submit(socketPath, prog({"x = object", "dump x"}), first);
+    std::stringstream second;
+    auto secondOk = submit(socketPath, prog("x = y"), second);
+    server.stop();
+    serving.join();
+
+    ASSERT_TRUE(firstOk);
+    ASSERT_THAT(first.str(), MatchesRegex(
+        R"--(dump x: strong\(\w+\), obj refCounter = 1, fields = \{\}\s+)--"
+        R"--(=== ok, [0-9.e-]+ ms, peak 1 objects\s*)--"
+    ));
+    ASSERT_FALSE(secondOk);
+    ASSERT_THAT(second.str(), MatchesRegex(R"--(=== error \(.*\), [0-9.e-]+ ms, peak 0 objects\s*)--"));
+    ASSERT_THAT(log.str(), MatchesRegex(R"--(ok, .*\s+error, .* \(2 requests, p50 .*\)\s*)--"));
+}
+
+TEST(Server, KeepsWhatIsNotStaleSocket) {
+    auto socketPath = (std::filesystem::temp_directory_path() / ("arc_server_" + std::to_string(getpid()))).string();
+    std::ofstream(socketPath) << "notes";
+    ASSERT_THROW(Server server(socketPath), std::system_error);
+    ASSERT_TRUE(std::filesystem::is_regular_file(socketPath));
+    std::filesystem::remove(socketPath);
+
+    std::optional<Server> serving(std::in_place, socketPath);
+    ASSERT_THROW(Server other(socketPath), std::system_error);
+    serving.reset();
+    // the endpoint is free again
+    Server next(socketPath);
+}
+
 #pragma clang diagnostic pop
\ No newline at end of file
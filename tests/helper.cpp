@@ -1,4 +1,5 @@
 #include "helper.h"
+#include "../parsing/parser.h"
 
 #include <sstream>
 #include <algorithm>
@@ -50,3 +51,12 @@ std::string repeat(uint times, std::string const & counter, std::initializer_lis
 
     return buf.str();
 }
+
+std::vector<std::unique_ptr<ast::Statement>> parse(std::string const & source) {
+    Parser parser(source.c_str());
+    std::vector<std::unique_ptr<ast::Statement>> statements;
+    while (parser.hasNext()) {
+        statements.push_back(parser.nextStatement());
+    }
+    return statements;
+}
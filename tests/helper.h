@@ -1,9 +1,15 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "../ast.h"
 
 std::string const & prog(std::string const & line);
 
 std::string prog(std::initializer_list<std::string> chunks);
 
 std::string repeat(uint times, std::string const & counter, std::initializer_list<std::string> chunks);
+
+std::vector<std::unique_ptr<ast::Statement>> parse(std::string const & source);